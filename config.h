@@ -5,6 +5,7 @@
 #define OPENER    "xdg-open"  // File opener on Linux/BSD
 #endif
 #define SUDOER    "sudo"      // Utility for sudo mode
+#define COPY_JOBS 4           // Number of processes copying files at once
 
 static Settings gcfg = {
 	.cols = "tOPsn",  // Columns: 't'ime, 'o'wner, 'p'erm, 's'ize, 'n'ame, Uppercase for placeholders
@@ -17,6 +18,7 @@ static Settings gcfg = {
 	.openfile   = 0,  // Open files on right arrow or 'l' key
 	.symbperm   = 0,  // Show permissions as symbolic strings
 	.abbrdate   = 0,  // Use ls-style date format
+	.session    = 0,  // Save the session on exit and restore it on start
 };
 
 /* Key definitions */
@@ -63,9 +65,11 @@ static const Key keys[] = {
 	{ 'f',           0,         quickfind,        0,    "         f  Quick find" },
 	{ 'n',           0,         qfindnext,        1,    "         n  Find next" },
 	{ 'N',           0,         qfindnext,       -1,    "         N  Find previous" },
+	{ 'z',           0,         jumpdir,          0,    "         z  Jump to a visited dir" },
 	{ CTRL('T'),     0,         togglemode,       0,    "        ^T  Toggle sudo mode" },
 	{ 'o',           0,         viewoptions,      0,    "         o  View options" },
 	{ 'u',           0,         prefixkey,        0,    "         u  Extension function prefix" },
+	{ CTRL('X'),     0,         canceljob,        0,    "        ^X  Cancel background job" },
 	{ '?',          KEY_F(1),   showhelp,         0,    "     F1, ?  Show this help" },
 	{ 'Q',           0,         quitsff,          0,    "         Q  Quit" },
 };
@@ -77,6 +81,7 @@ static void setcolorpair256(void)
 	init_pair( F_REG,           -1,      -1 ); // Regular file
 	init_pair( F_DIR,     COLOR_BLUE,    -1 ); // Directory
 	init_pair( F_LNK,     COLOR_CYAN,    -1 ); // Symbolic link
+	init_pair( F_ORPH,    COLOR_RED,     -1 ); // Dangling symbolic link
 	init_pair( F_CHR,     COLOR_YELLOW,  -1 ); // Char device
 	init_pair( F_BLK,     COLOR_YELLOW,  -1 ); // Block device
 	init_pair( F_IFO,     COLOR_YELLOW,  -1 ); // FIFO
@@ -98,6 +103,7 @@ static void setcolorpair8(void)
 	init_pair( F_REG,           -1,      -1 ); // Regular file
 	init_pair( F_DIR,     COLOR_BLUE,    -1 ); // Directory
 	init_pair( F_LNK,     COLOR_CYAN,    -1 ); // Symbolic link
+	init_pair( F_ORPH,    COLOR_RED,     -1 ); // Dangling symbolic link
 	init_pair( F_CHR,     COLOR_YELLOW,  -1 ); // Char device
 	init_pair( F_BLK,     COLOR_YELLOW,  -1 ); // Block device
 	init_pair( F_IFO,     COLOR_YELLOW,  -1 ); // FIFO
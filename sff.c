@@ -32,20 +32,35 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/fs.h> // FICLONE
+#endif
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdalign.h>
 #include <stddef.h>
+#include <limits.h>
 #include <ctype.h>
 #include <locale.h>
 #include <wchar.h>
 #include <grp.h>
 #include <pwd.h>
 #include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <ftw.h>
 #define NCURSES_WIDECHAR 1
 #include <curses.h>
 
@@ -64,6 +79,28 @@
 #define NAME_INCR      4096 // 128 entries * avg. 32 chars per name = 4KB
 #define FILT_MAX       128 // Maximum length of filter string
 #define HSTAT_INCR     16 // Number of Histstat structures to allocate each time
+#define QUERY_MAX      16 // Maximum number of metadata query terms in filter
+#define SEL_HINIT      16 // Initial number of hash slots for selected names per directory
+#define SEL_DEL        ((unsigned int)-1) // Hash slot of a removed name
+#define SEL_WBUF       65536 // Selected paths are written to the pipe in chunks of this size
+#define DU_TTL         60 // Seconds to reuse a computed directory size
+#define IDNAME_TTL     300 // Seconds to reuse a user or group name before looking it up again
+#define FOLD_BLOCK     32 // Entries per block of the table of lowest positions in the quick find index
+#define LNK_SYNC       64 // Most symlinks followed before sorting, more are followed by the link worker
+#define CTL_MAX        4 // Number of control socket clients served at once
+#define CTL_IDLE       10 // Seconds a control client may stay silent before a new client can take its place
+#define FIND_DELAY     200 // Milliseconds between loads of search results that are still streaming in
+#define SESS_FILE      "session" // Session file in cfgpath
+#define SESS_MAGIC     "sffsess1" // Header of the session file, changed with its layout
+#define HLP_BUF        65536 // Largest reply of the privileged helper, directory listings are sent in parts of this size
+#define DIRDB_FILE     "dirs" // Index of visited directories in cfgpath, visits since it was built are logged in DIRDB_FILE.log
+#define DIRDB_MAGIC    "sffdirs1" // Header of the index, changed with its layout
+#define DIRDB_LOGMAX   65536 // Size of the log at which it is merged into the index on start
+#define DIRDB_AGING    100000 // Total visits in the index above which all counts are aged by 10% when merging
+#define JUMP_MAX       8 // Number of matches kept by the jump prompt
+#define CP_CHUNK       (1 << 24) // Bytes copied in the kernel at a time, so that a large file is reported as it goes
+#define CP_REPORT      100 // Milliseconds between progress reports of each background job process
+#define MODEOP_MAX     16 // Clauses in a symbolic chmod mode
 
 #define LENGTH(X)      (sizeof X / sizeof X[0])
 #define MIN(x, y)      ((x) < (y) ? (x) : (y))
@@ -71,7 +108,7 @@
 
 enum entryflag {
 	E_REG_FILE = 0x01, E_DIR_DIRLNK = 0x02,
-	E_SEL = 0x04, E_SEL_SCANED = 0x08, E_NEW = 0x10
+	E_SEL = 0x04, E_NEW = 0x08, E_LNK_PEND = 0x10 // symlink target not followed yet
 };
 
 enum filetypes {
@@ -88,7 +125,15 @@ enum histstatflag {
 };
 
 enum procctrl {
-	GO_NONE = 0, GO_STATBAR, GO_FASTDRAW, GO_REDRAW, GO_SORT, GO_RELOAD, GO_QUIT
+	GO_NONE = 0, GO_STATBAR, GO_FASTDRAW, GO_SCROLL, GO_REDRAW, GO_SORT, GO_RELOAD, GO_QUIT
+};
+
+enum evtimer {
+	T_NEWMARK = 0, T_FINDLOAD, T_NUM
+};
+
+enum filtmode {
+	FM_SUBSTR = 0, FM_FUZZY, FM_REGEX, FM_GLOB, FM_NUM
 };
 
 typedef struct {
@@ -102,7 +147,8 @@ typedef struct {
 	unsigned short type; // 2 bytes
 	unsigned short flag; // 2 bytes
 	unsigned short nlen; // 2 bytes
-	unsigned short misc; // 2 bytes
+	unsigned short misc; // 2 bytes, fuzzy filter score
+	unsigned short color; // 2 bytes, index of the name attribute in pstyle
 } Entry;
 
 typedef struct {
@@ -120,13 +166,25 @@ typedef struct {
 	unsigned int ths;
 } Histpath;
 
+struct selslot {
+	unsigned int hash;
+	unsigned int off; // Offset of name in nbuf, 0 for empty slots, SEL_DEL for removed names
+	int cat; // Index into Tabs.selcnt
+	off_t size; // -1 for a directory waiting for its size
+};
+
 struct selstat {
 	struct selstat *prev;
 	struct selstat *next;
 	char path[PATH_MAX];
-	char *nbuf;
+	char *nbuf; // Selected names in order, each preceded by a live flag byte
 	char *endp;
 	size_t buflen;
+	struct selslot *htab; // Hash set of names
+	unsigned int hcap;
+	unsigned int nname; // Number of selected names
+	unsigned int ndel; // Number of removed names left in nbuf
+	unsigned int phash; // Hash of path
 };
 
 typedef struct {
@@ -150,20 +208,47 @@ typedef struct {
 	unsigned int openfile   : 1;  // Open files on right arrow or 'l' key
 	unsigned int symbperm   : 1;  // Show permissions as symbolic strings
 	unsigned int abbrdate   : 1;  // Use ls-style date format
+	unsigned int session    : 1;  // Save the session on exit and restore it on start
 } Settings;
 
 typedef struct {
 	Histpath *hp;
 	struct selstat *ss;
+	struct selstat **ssmap; // Open addressing map of selstat by path
+	unsigned int ssmapcap;
+	unsigned int nss;
 	char filt[FILT_MAX];
 	char find[FILT_MAX];
 	int ftlen;
+	int ftmode;
 	int fdlen;
 	int nde;
 	int nsel;
+	int selcnt[4]; // Selected files, directories, symlinks and others
+	int selpend; // Selected directories waiting for their size
+	off_t selsize;
 	Settings cfg;
 } Tabs;
 
+typedef struct {
+	int key; // Index of query key, -1 for an incomplete term
+	int op;
+	int neg;
+	long long num;
+	const char *str;
+} Query;
+
+struct hlpmsg {
+	int code; // Request: operation, reply: errno or 0
+	unsigned int len; // Bytes that follow
+};
+
+struct hlpent {
+	struct stat sb;
+	mode_t tmode; // Mode of a symlink target, 0 if dangling
+	unsigned int nlen; // Length of the name that follows, including terminating '\0'
+};
+
 typedef struct {
 	int keysym1;
 	int keysym2;
@@ -174,16 +259,72 @@ typedef struct {
 
 /*** Global Variables ***/
 
-static int ndents = 0, tdents = 0, cursel = 0, lastsel = -1, curscroll = 0;
+static int ndents = 0, tdents = 0, cursel = 0, lastsel = -1, curscroll = 0, drawnscroll = 0, namecolx = 0;
+static int dirtylo = INT_MAX, dirtyhi = -1; // Rows changed by keys handled without drawing
+static int syncout = FALSE; // Terminal supports synchronized output (DEC mode 2026)
 static int markent = -1, errline = 0, errnum = 0;
 static int xlines, xcols, onscr, ncols;
 static size_t namebuflen = 0;
 static time_t curtime;
-static char *home, *opener, *sudoer;
-static char *cfgpath = NULL, *extfunc = NULL, *pipepath = NULL, *pvfifo = NULL;
+static time_t newmarkend; // When the earliest new-file mark of the view expires, 0 if none
+static char *home, *opener, *sudoer, *selfpath = NULL;
+static char *cfgpath = NULL, *extfunc = NULL, *pipepath = NULL, *pvfifo = NULL, *sockpath = NULL;
 static char *pnamebuf = NULL, *pfindbuf = NULL, *pfindend = NULL, *findname = NULL;
 static Entry *pdents = NULL;
+static int *pfoldidx = NULL, *phitidx = NULL, nfoldidx = -1, nhitidx = -1, curhit = 0;
+static int *pfoldmin = NULL, nfoldblk = 0, nfoldlvl = 0; // Lowest positions of runs of 2^level blocks of pfoldidx
+static unsigned int *pnameidx = NULL, nameidxcap = 0;
+static int nnameidx = -1;
+static char hitstr[FILT_MAX];
 static Tabs *ptab = NULL;
+static struct ducache { unsigned int hash; time_t time; off_t size; char *path; } *pducache = NULL;
+static unsigned int ducachecap = 0, nducache = 0;
+static char **pduqueue = NULL;
+static struct idname { unsigned long long key; time_t time; int pending; char name[32]; } *pidcache = NULL; // key: group flag << 33 | (id + 1)
+static unsigned long long *pidqueue = NULL;
+static unsigned int idcachecap = 0, nidcache = 0;
+static int nidqueue = 0, nidjob = 0, idfd = -1;
+static struct dispname { const char *name; size_t off, loff; time_t tsec; char tstr[24]; } *pdispidx = NULL; // Display cache keyed by Entry.name
+static wchar_t *pdispbuf = NULL;
+static char *plnkbuf = NULL; // Symlink targets of cached entries
+static size_t dispbuflen = 0, dispbufcap = 0, lnkbuflen = 0, lnkbufcap = 0;
+static unsigned int dispidxcap = 0, ndispidx = 0;
+static int dispcols = -1;
+static attr_t *pstyle = NULL; // Name attributes indexed by Entry.color, the first F_UNKN + 1 are per file type
+static unsigned int nstyle = 0, stylecap = 0;
+static struct lsrule { const char *sfx; unsigned int hash; unsigned short style; } *plsext = NULL, *plssfx = NULL; // LS_COLORS suffix rules
+static unsigned int lsextcap = 0, nlssfx = 0;
+static char *plscolors = NULL; // Copy of LS_COLORS, holds the rule suffixes
+static int nduqueue = 0, ndujob = 0, dufd = -1;
+static struct lnkres { unsigned int off; int res; } *plnkres = NULL; // off: of the name in pnamebuf, res: see followlink
+static size_t lnkreslen = 0, lnkrescap = 0; // In bytes
+static unsigned int loadgen = 0, lnkgen = 0; // Listings loaded, and the one the link worker follows
+static int lnkfd = -1;
+static int sigfd[2] = {-1, -1}; // Self-pipe, signal handlers write the signal number to it
+static struct sigaction cursessigwinch; // SIGWINCH handler of curses, called by ours
+static long long timerat[T_NUM]; // Timer deadlines in ms of CLOCK_MONOTONIC, 0 if unset
+static int ctlfd = -1; // Listening control socket
+static int findfd = -1, nfindres = 0; // Pipe of search results still streaming in, and results read so far
+static size_t findlen = 0, findcap = 0; // Bytes read into pfindbuf, including a partial result, and its size
+static int hlpfd = -1, hlpcwd = FALSE; // Socket to the privileged helper, and whether the working directory is only browsed through it
+static pid_t hlppid = -1;
+static struct ctlconn { int fd; long long seen; size_t len, reslen, rescap; char *res; char buf[PATH_MAX + 2]; } ctlconn[CTL_MAX]; // res: pushed search results, seen: time of last read
+static const struct dirrec { unsigned int off, boff, count, last; } *pdirrec = NULL; // Index of visited directories, sorted by path
+static const char *pdirpath = NULL, *pdirbase = NULL; // Paths of the index, and their last components in lowercase
+static char *pdirmap = NULL, *dirlogpath = NULL;
+static size_t dirmaplen = 0;
+static unsigned int ndirrec = 0, dirpathlen = 0, dirbaselen = 0;
+static struct dirvisit { char *path; unsigned int hash, count, last; int idx, reset; } *pdirvisit = NULL; // Logged visits, idx: index record of the path, reset: forgotten since the index was built
+static unsigned int ndirvisit = 0, dirvisitcap = 0;
+static unsigned char *pdirseen = NULL; // Bit per index record that has a dirvisit
+static const char *pjumpres[JUMP_MAX]; // Matches of the jump prompt, best first
+static int jplen = 0, njumpres = 0, jumpsel = 0; // jplen works like fdlen
+static char jumpstr[FILT_MAX];
+static int cpfd = -1, cpkind = 0, cperr = 0; // Progress pipe of the job in the background, its kind (see startcopy) and first failure
+static pid_t cppid = 0; // Process group of the job
+static unsigned int cpfiles[2]; // Files done, found
+static off_t cpbytes[2];
+static char cppath[PATH_MAX]; // First target, selected when done
 
 alignas(max_align_t) static char gpbuf[PATH_MAX * sizeof(wchar_t)] = {0};
 alignas(max_align_t) static Tabs gtab[TABS_MAX + 1] = {{0}};
@@ -385,32 +526,29 @@ static char *strperms(mode_t mode)
 	return str;
 }
 
-/* Returns the cached user name if the provided uid is the same as the previous uid. */
-static char *getpwname(uid_t uid)
+/* FNV-1a hash of a string */
+static unsigned int hashstr(const char *str)
 {
-	static char *unamecache = NULL;
-	static uid_t uidcache = (uid_t)-1;
+	unsigned int h = 2166136261u;
 
-	if (uid != uidcache) {
-		struct passwd *pw = getpwuid(uid);
-		unamecache = pw ? pw->pw_name : NULL;
-		uidcache = uid;
-	}
-	return unamecache ? unamecache : xitoa(uid);
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+	return h;
 }
 
-/* Returns the cached group name if the provided gid is the same as the previous gid. */
-static char *getgrname(gid_t gid)
+/* Milliseconds of CLOCK_MONOTONIC, for timers */
+static long long monotime(void)
 {
-	static char *gnamecache = NULL;
-	static gid_t gidcache = (gid_t)-1;
+	struct timespec ts;
 
-	if (gid != gidcache) {
-		struct group *gr = getgrgid(gid);
-		gnamecache = gr ? gr->gr_name : NULL;
-		gidcache = gid;
-	}
-	return gnamecache ? gnamecache : xitoa(gid);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Fire timer id after ms milliseconds, or cancel it if ms < 0 */
+static void settimer(int id, long long ms)
+{
+	timerat[id] = (ms < 0) ? 0 : monotime() + ms;
 }
 
 static int seterrnum(int line, int err)
@@ -440,6 +578,8 @@ static void spawn(char *arg0, char *arg1, char *arg2, int detach)
 			if (pid != 0)
 				_exit(EXIT_SUCCESS);
 			setsid();
+			if (sockpath) // sff keeps serving the socket while detached children run
+				setenv("SFF_SOCKET", sockpath, 1);
 			// Suppress stdout and stderr
 			int fd = open("/dev/null", O_WRONLY, 0200);
 			if (fd != -1) {
@@ -458,6 +598,331 @@ static void spawn(char *arg0, char *arg1, char *arg2, int detach)
 		seterrnum(__LINE__, errno);
 }
 
+/* Write all of buf, retrying on short writes */
+static int writeall(int fd, const char *buf, size_t len)
+{
+	for (ssize_t n; len > 0; buf += n, len -= n) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Read exactly len bytes into buf, retrying on short reads. Fails with EPIPE at end of file. */
+static int readall(int fd, char *buf, size_t len)
+{
+	for (ssize_t n; len > 0; buf += n, len -= n) {
+		if ((n = read(fd, buf, len)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n == 0)
+				errno = EPIPE;
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Privileged helper: in sudo mode, sff runs itself once as "$SFF_SUDOER sff -P" with a socketpair
+ * on its stdin and stdout. The helper lists, stats and reads links in directories the user cannot
+ * access, and runs extension functions as root. Each request and reply is a struct hlpmsg and
+ * the bytes that follow it; a directory listing is sent as replies of hlpent records, ended by
+ * an empty reply.
+ */
+
+static void stophelper(void)
+{
+	if (hlpfd == -1)
+		return;
+	shutdown(hlpfd, SHUT_RDWR); // Workers forked without exec hold copies of it
+	close(hlpfd);
+	hlpfd = -1;
+	if (hlppid > 0)
+		waitpid(hlppid, NULL, 0); // It exits at end of file
+	hlppid = -1;
+}
+
+/* Start the helper through SFF_SUDOER, which may ask for a password. Returns TRUE if it is running. */
+static int starthelper(void)
+{
+	int sv[2];
+	struct hlpmsg msg = {-1, 0};
+	struct sigaction oldsigtstp, oldsigwinch;
+
+	if (hlpfd != -1)
+		return TRUE;
+	if (!selfpath || (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 && seterrnum(__LINE__, errno)))
+		return FALSE;
+
+	endwin();
+	sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsigtstp);
+	sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsigwinch);
+	hlppid = fork();
+	if (hlppid == 0) {
+		close(sv[0]);
+		dup2(sv[1], STDIN_FILENO);
+		dup2(sv[1], STDOUT_FILENO);
+		close(sv[1]);
+		execlp(sudoer, sudoer, selfpath, "-P", (char *)NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	hlpfd = sv[0];
+	if (hlppid == -1 || !readall(hlpfd, (char *)&msg, sizeof(msg)) || msg.code != 0) { // Says its euid when ready
+		seterrnum(__LINE__, hlppid == -1 ? errno : EPERM);
+		stophelper();
+	}
+	sigaction(SIGTSTP, &oldsigtstp, NULL);
+	sigaction(SIGWINCH, &oldsigwinch, NULL);
+	return hlpfd != -1;
+}
+
+/* Send a request to the helper, passing nfd file descriptors along with it */
+static int hlpsend(int op, const char *arg, size_t len, const int *fds, int nfd)
+{
+	struct hlpmsg msg = {op, (unsigned int)len};
+	struct iovec iov[2] = {{&msg, sizeof(msg)}, {(void *)arg, len}};
+	union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int) * 3)]; } cbuf;
+	struct msghdr mh = {.msg_iov = iov, .msg_iovlen = 2};
+	int err;
+
+	if (hlpfd == -1) {
+		errno = EPIPE;
+		return FALSE;
+	}
+	if (nfd > 0) {
+		mh.msg_control = cbuf.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfd);
+	}
+	if (sendmsg(hlpfd, &mh, 0) == (ssize_t)(sizeof(msg) + len))
+		return TRUE;
+	err = errno;
+	stophelper();
+	errno = err;
+	return FALSE;
+}
+
+/* Read a reply of the helper into buf. Returns its length, or -1 with errno set by the helper. */
+static ssize_t hlprecv(char *buf, size_t cap)
+{
+	struct hlpmsg msg;
+
+	if (hlpfd == -1 || !readall(hlpfd, (char *)&msg, sizeof(msg))
+	|| msg.len > cap || !readall(hlpfd, buf, msg.len)) {
+		stophelper();
+		errno = EPIPE;
+		return -1;
+	}
+	if (msg.code != 0) {
+		errno = msg.code;
+		return -1;
+	}
+	return msg.len;
+}
+
+/* lstat ('S'), stat ('T') or readlink ('K') name, relative to the current tab, through the helper.
+   Returns the length of the result in buf, or -1. */
+static ssize_t hlppathop(int op, const char *name, char *buf, size_t cap)
+{
+	char path[PATH_MAX];
+	int len = (name[0] == '/') ? (int)strlen(name) + 1 : makepath(ptab->hp->path, name, path);
+
+	if ((len <= 0 || len > PATH_MAX) && (errno = ENAMETOOLONG))
+		return -1;
+	if (!hlpsend(op, (name[0] == '/') ? name : path, len, NULL, 0))
+		return -1;
+	return hlprecv(buf, cap);
+}
+
+/* fstatat(), through the helper while the working directory is not the one browsed */
+static int entstat(int fd, const char *name, struct stat *sb, int flag)
+{
+	if (!hlpcwd)
+		return fstatat(fd, name, sb, flag);
+	return hlppathop(flag ? 'S' : 'T', name, (char *)sb, sizeof(struct stat)) == sizeof(struct stat) ? 0 : -1;
+}
+
+/* Have the helper run argv in dir as root, on our terminal. Returns the pid of the helper, or -1. */
+static pid_t hlpspawn(const char *dir, char *const *argv)
+{
+	char req[PATH_MAX * 4], *p = memccpy(req, dir, '\0', PATH_MAX);
+
+	for (int i = 0; p && argv[i] && i < 3; ++i)
+		p = memccpy(p, argv[i], '\0', PATH_MAX);
+	if (!p && seterrnum(__LINE__, ENAMETOOLONG))
+		return -1;
+	if (!hlpsend('X', req, p - req, (int [3]){STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}, 3)
+	&& seterrnum(__LINE__, errno))
+		return -1;
+	return hlppid;
+}
+
+/* Send a reply to sff from the helper */
+static int hlpreply(int code, const char *buf, size_t len)
+{
+	struct hlpmsg msg = {code, (unsigned int)len};
+	return writeall(STDOUT_FILENO, (char *)&msg, sizeof(msg)) && writeall(STDOUT_FILENO, buf, len);
+}
+
+static int hlplistdir(const char *path, char *buf)
+{
+	struct dirent *dp;
+	struct hlpent he;
+	struct stat tsb;
+	size_t len = 0, nlen;
+	DIR *dirp = opendir(path);
+
+	if (!dirp)
+		return hlpreply(errno, NULL, 0);
+
+	while ((dp = readdir(dirp))) {
+		char *name = dp->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (fstatat(dirfd(dirp), name, &he.sb, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+
+		he.tmode = he.sb.st_mode;
+		if (S_ISLNK(he.sb.st_mode)) {
+			if (fstatat(dirfd(dirp), name, &tsb, 0) == 0)
+				he.tmode = tsb.st_mode;
+			else if (errno == ENOENT || errno == ENOTDIR || errno == ELOOP)
+				he.tmode = 0;
+		}
+		nlen = strlen(name) + 1;
+		he.nlen = nlen;
+		if (len + sizeof(he) + nlen > HLP_BUF) {
+			if (!hlpreply(0, buf, len))
+				break;
+			len = 0;
+		}
+		memcpy(buf + len, &he, sizeof(he));
+		memcpy(buf + len + sizeof(he), name, nlen);
+		len += sizeof(he) + nlen;
+	}
+	closedir(dirp);
+	return (len == 0 || hlpreply(0, buf, len)) && hlpreply(0, NULL, 0);
+}
+
+/* Run an extension function as root: args are sff's pid, the directory, and its argv */
+static int hlpextfunc(char *arg, size_t len, const int *fds, pid_t peer)
+{
+	char *argv[5] = {NULL};
+	int n = 0, status;
+	pid_t pid;
+
+	for (char *p = arg; n < 4 && p < arg + len; p += strlen(p) + 1)
+		argv[n++] = p;
+	if (n < 4)
+		return hlpreply(EINVAL, NULL, 0);
+
+	pid = fork();
+	if (pid == 0) {
+		for (int i = 0; i < 3; ++i)
+			dup2(fds[i], i);
+		sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
+		sigaction(SIGINT, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+		sigaction(SIGQUIT, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+		sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+		if (chdir(argv[0]) == 0)
+			execv(argv[1], &argv[1]);
+		_exit(EXIT_FAILURE);
+	}
+	if (pid > 0)
+		waitpid(pid, &status, 0);
+	if (peer > 0) // As if sff's own child exited, to end a blocking open of the pipe
+		kill(peer, SIGCHLD);
+	return hlpreply(pid == -1 ? errno : 0, NULL, 0);
+}
+
+/* Serve the sff instance on the other end of stdin and stdout until it exits (-P option) */
+static int runhelper(void)
+{
+	static char buf[HLP_BUF], arg[PATH_MAX * 4];
+	union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int) * 3)]; } cbuf;
+	struct hlpmsg msg = {(int)geteuid(), 0};
+	struct iovec iov = {&msg, sizeof(msg)};
+	struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+	struct stat sb;
+	int fds[3], nfd, ok;
+	ssize_t n;
+#ifdef SO_PEERCRED
+	struct ucred cr = {0};
+	socklen_t crlen = sizeof(cr);
+	// The process that made the socketpair, as the kernel has it, not as the other end says
+	pid_t peer = (getsockopt(STDIN_FILENO, SOL_SOCKET, SO_PEERCRED, &cr, &crlen) == 0) ? cr.pid : -1;
+#else
+	pid_t peer = getppid(); // SFF_SUDOER may have run us in its place
+#endif
+
+	sigaction(SIGINT, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
+	sigaction(SIGQUIT, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
+	sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
+	sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
+	if (!hlpreply(msg.code, NULL, 0))
+		return FALSE;
+
+	for (ok = TRUE; ok; ) {
+		mh.msg_control = cbuf.buf;
+		mh.msg_controllen = sizeof(cbuf.buf);
+		if ((n = recvmsg(STDIN_FILENO, &mh, 0)) == -1 && errno == EINTR)
+			continue;
+		if (n <= 0 || ((size_t)n < sizeof(msg) && !readall(STDIN_FILENO, (char *)&msg + n, sizeof(msg) - n)))
+			break;
+
+		nfd = 0;
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+				nfd = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				memcpy(fds, CMSG_DATA(cm), sizeof(int) * nfd);
+			}
+		}
+		if (msg.len >= sizeof(arg) || !readall(STDIN_FILENO, arg, msg.len))
+			break;
+		arg[msg.len] = '\0';
+
+		switch (msg.code) {
+		case 'L':
+			ok = hlplistdir(arg, buf);
+			break;
+		case 'S': // fallthrough
+		case 'T':
+			if (fstatat(AT_FDCWD, arg, &sb, msg.code == 'S' ? AT_SYMLINK_NOFOLLOW : 0) == -1)
+				ok = hlpreply(errno, NULL, 0);
+			else
+				ok = hlpreply(0, (char *)&sb, sizeof(sb));
+			break;
+		case 'K':
+			n = readlink(arg, buf, PATH_MAX - 1);
+			ok = hlpreply(n == -1 ? errno : 0, buf, n == -1 ? 0 : n);
+			break;
+		case 'X':
+			ok = (nfd == 3) ? hlpextfunc(arg, msg.len, fds, peer) : hlpreply(EINVAL, NULL, 0);
+			break;
+		default:
+			ok = hlpreply(EINVAL, NULL, 0);
+		}
+		for (int i = 0; i < nfd; ++i)
+			close(fds[i]);
+	}
+	return TRUE;
+}
+
 /****** Key Functions ******/
 
 static int movecursor(int n);
@@ -478,15 +943,18 @@ static int clearselection(int n);
 static int setfilter(int n);
 static int quickfind(int n);
 static int qfindnext(int n);
+static int jumpdir(int n);
 static int switchtab(int n);
 static int closetab(int n);
 static int togglemode(int n);
 static int viewoptions(int n);
 static int prefixkey(int n);
+static int canceljob(int n);
 static int showhelp(int n);
 static int quitsff(int n);
 static int callextfunc(int c);
 
+#undef CTRL // From <termios.h>, config.h has its own
 #include "config.h" // Configuration
 
 static int shiftcursor(int step, int scrl)
@@ -507,7 +975,7 @@ static int shiftcursor(int step, int scrl)
 
 	if (lastscroll == curscroll)
 		return GO_FASTDRAW;
-	return GO_REDRAW;
+	return GO_SCROLL;
 }
 
 static int movecursor(int n)
@@ -546,12 +1014,37 @@ static void savehiststat(Histstat *hs)
 	}
 }
 
+/* After EACCES in sudo mode, start the helper to retry through it. Leaves errno as it was if not. */
+static int usehelper(void)
+{
+	int err = errno;
+
+	if (err == EACCES && gcfg.runmode == 1 && starthelper())
+		return TRUE;
+	errno = err;
+	return FALSE;
+}
+
+/* chdir() to path. A directory the user cannot enter in sudo mode is browsed through the helper,
+   leaving the working directory as it was. */
+static int changedir(const char *path)
+{
+	if (chdir(path) == 0)
+		hlpcwd = FALSE;
+	else if (usehelper())
+		hlpcwd = TRUE;
+	else
+		return -1;
+	return 0;
+}
+
 static Histpath *inithistpath(Histpath *hp, const char *path)
 {
 	const char *name = NULL;
 	struct stat sb;
 
-	if (lstat(path, &sb) == -1 && seterrnum(__LINE__, errno))
+	if (lstat(path, &sb) == -1 && (!usehelper() || hlppathop('S', path, (char *)&sb, sizeof(sb)) == -1)
+	&& seterrnum(__LINE__, errno))
 		return NULL;
 	if (hp->path == path)
 		return hp;
@@ -600,7 +1093,7 @@ static int newhistpath(const char *path, int force)
 	if (strcmp(hp->path, path) == 0 || (gcfg.ct == TABS_MAX && !force))
 		return GO_NONE;
 
-	if (!inithistpath(hp2, path) || (chdir(hp2->path) == -1 && seterrnum(__LINE__, errno)))
+	if (!inithistpath(hp2, path) || (changedir(hp2->path) == -1 && seterrnum(__LINE__, errno)))
 		return GO_STATBAR;
 
 	if (hp->stat->flag == S_ROOT)
@@ -616,7 +1109,7 @@ static int switchhistpath(int n)
 	Histpath *hp = ptab->hp;
 	Histpath *hp2 = ((hp - ghpath) & 1) ? hp - 1 : hp + 1;
 
-	if ((gcfg.ct == TABS_MAX && n == 0) || !hp2->path[0] || chdir(hp2->path) == -1)
+	if ((gcfg.ct == TABS_MAX && n == 0) || !hp2->path[0] || changedir(hp2->path) == -1)
 		return GO_NONE;
 
 	savehiststat(hp->stat);
@@ -625,6 +1118,32 @@ static int switchhistpath(int n)
 	return GO_RELOAD;
 }
 
+/* Follow a symlink: returns 1 if it points to a directory, -1 if it dangles, 0 otherwise */
+static int followlink(const char *name)
+{
+	struct stat sb;
+
+	if (entstat(AT_FDCWD, name, &sb, 0) == -1)
+		return (errno == ENOENT || errno == ENOTDIR || errno == ELOOP) ? -1 : 0;
+	return S_ISDIR(sb.st_mode) ? 1 : 0;
+}
+
+static void setlink(Entry *ent, int res)
+{
+	ent->flag &= ~E_LNK_PEND;
+	if (res < 0)
+		ent->type = ent->color = F_ORPH;
+	else if (res > 0)
+		ent->flag |= E_DIR_DIRLNK;
+}
+
+/* Follow a symlink entry on first use, marking links to directories and dangling links */
+static void resolvelink(Entry *ent)
+{
+	if (ent->flag & E_LNK_PEND)
+		setlink(ent, followlink(ent->name));
+}
+
 static int enterdir(int n)
 {
 	Histpath *hp = ptab->hp;
@@ -638,6 +1157,7 @@ static int enterdir(int n)
 
 	Entry *ent = &pdents[cursel];
 	makepath(hp->path, ent->name, newpath);
+	resolvelink(ent);
 	if (!(ent->flag & E_DIR_DIRLNK)) {
 		if (n == 1 || gcfg.openfile == 1)
 			spawn(opener, gpbuf, NULL, TRUE);
@@ -660,7 +1180,7 @@ static int enterdir(int n)
 		hp->hs = tmphs;
 	}
 
-	if (chdir(newpath) == -1 && seterrnum(__LINE__, errno))
+	if (changedir(newpath) == -1 && seterrnum(__LINE__, errno))
 		return GO_STATBAR;
 
 	if (nhs < hp->nhs) {
@@ -705,7 +1225,7 @@ static int gotoparent(int n __attribute__((unused)))
 			memccpy(hs->name, xbasename(path), '\0', NAME_MAX);
 			hs->flag = S_VIS;
 		}
-	} while (chdir(xdirname(path)) == -1 && path[1] != '\0' && hs->flag != S_SUBROOT);
+	} while (changedir(xdirname(path)) == -1 && path[1] != '\0' && hs->flag != S_SUBROOT);
 
 	findname = hs->name;
 	ptab->hp->stat = hs;
@@ -732,6 +1252,59 @@ static int refreshview(int n)
 	return GO_RELOAD;
 }
 
+/* Insert (add=TRUE) or remove a selstat in the path map of tab. The map is rebuilt from the list when grown. */
+static int mapselstat(Tabs *tab, struct selstat *ss, int add)
+{
+	unsigned int mask = tab->ssmapcap - 1, i, j, k;
+
+	if (add && (tab->nss + 1) * 2 > tab->ssmapcap) {
+		unsigned int cap = MAX(8, tab->ssmapcap * 2);
+		struct selstat **tmp = calloc(cap, sizeof(struct selstat *));
+		if (!tmp && seterrnum(__LINE__, errno))
+			return FALSE;
+		free(tab->ssmap);
+		tab->ssmap = tmp;
+		tab->ssmapcap = cap;
+		tab->nss = 0;
+		for (struct selstat *n = ss->prev; n; n = n->prev) // ss is the tail of the list
+			mapselstat(tab, n, TRUE);
+		mask = cap - 1;
+	}
+
+	if (add) {
+		for (i = ss->phash & mask; tab->ssmap[i]; i = (i + 1) & mask)
+			;
+		tab->ssmap[i] = ss;
+		++tab->nss;
+		return TRUE;
+	}
+
+	for (i = ss->phash & mask; tab->ssmap[i] != ss; i = (i + 1) & mask)
+		;
+	for (j = i; tab->ssmap[j = (j + 1) & mask]; ) { // Shift following entries back to keep probe chains intact
+		k = tab->ssmap[j]->phash & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			tab->ssmap[i] = tab->ssmap[j];
+			i = j;
+		}
+	}
+	tab->ssmap[i] = NULL;
+	--tab->nss;
+	return TRUE;
+}
+
+static struct selstat *findselstat(Tabs *tab, const char *path)
+{
+	unsigned int h = hashstr(path), mask = tab->ssmapcap - 1;
+
+	if (tab->nss == 0)
+		return NULL;
+	for (unsigned int i = h & mask; tab->ssmap[i]; i = (i + 1) & mask)
+		if (tab->ssmap[i]->phash == h && strcmp(tab->ssmap[i]->path, path) == 0)
+			return tab->ssmap[i];
+	return NULL;
+}
+
 static struct selstat *addselstat(struct selstat *ss, const char *path)
 {
 	struct selstat *n = malloc(sizeof(struct selstat));
@@ -739,8 +1312,11 @@ static struct selstat *addselstat(struct selstat *ss, const char *path)
 	if (!n && seterrnum(__LINE__, errno))
 		return NULL;
 
-	n->nbuf = calloc(NAME_INCR, 1);
-	if (!n->nbuf && seterrnum(__LINE__, errno)) {
+	n->nbuf = malloc(NAME_INCR);
+	n->htab = calloc(SEL_HINIT, sizeof(struct selslot));
+	if ((!n->nbuf || !n->htab) && seterrnum(__LINE__, errno)) {
+		free(n->nbuf);
+		free(n->htab);
 		free(n);
 		return NULL;
 	}
@@ -754,8 +1330,11 @@ static struct selstat *addselstat(struct selstat *ss, const char *path)
 	n->next = NULL;
 
 	memccpy(n->path, path, '\0', PATH_MAX);
+	n->phash = hashstr(n->path);
 	n->endp = n->nbuf;
 	n->buflen = NAME_INCR;
+	n->hcap = SEL_HINIT;
+	n->nname = n->ndel = 0;
 	return n;
 }
 
@@ -764,6 +1343,7 @@ static void deleteselstat(struct selstat *ss)
 	if (!ss)
 		return;
 
+	mapselstat(ptab, ss, FALSE);
 	ptab->ss = NULL;
 	if (ss->prev) {
 		ss->prev->next = ss->next;
@@ -775,15 +1355,16 @@ static void deleteselstat(struct selstat *ss)
 	}
 
 	free(ss->nbuf);
+	free(ss->htab);
 	free(ss);
 	ptab->cfg.havesel = 0;
 	if (!ptab->ss)
 		ptab->cfg.mansel = 0;
 }
 
-static void deleteallselstat(struct selstat *ss)
+static void deleteallselstat(Tabs *tab)
 {
-	struct selstat *tmp;
+	struct selstat *tmp, *ss = tab->ss;
 
 	if (!ss)
 		return;
@@ -794,9 +1375,33 @@ static void deleteallselstat(struct selstat *ss)
 	while (ss) {
 		tmp = ss->prev;
 		free(ss->nbuf);
+		free(ss->htab);
 		free(ss);
 		ss = tmp;
 	}
+
+	tab->ss = NULL;
+	tab->nss = 0;
+	memset(tab->ssmap, 0, tab->ssmapcap * sizeof(struct selstat *));
+	memset(tab->selcnt, 0, sizeof(tab->selcnt));
+	tab->selpend = 0;
+	tab->selsize = 0;
+}
+
+/* Add an empty selstat for path to the list and the map of tab */
+static struct selstat *newselstat(Tabs *tab, const char *path)
+{
+	struct selstat *ss = addselstat(tab->ss, path);
+
+	if (ss && !mapselstat(tab, ss, TRUE)) {
+		if (ss->prev)
+			ss->prev->next = NULL;
+		free(ss->nbuf);
+		free(ss->htab);
+		free(ss);
+		return NULL;
+	}
+	return ss;
 }
 
 static struct selstat *getselstat(void)
@@ -807,80 +1412,659 @@ static struct selstat *getselstat(void)
 		return NULL;
 
 	if (!ptab->cfg.havesel) {
-		ss = addselstat(ss, ptab->hp->path);
-		if (ss)
-			ptab->cfg.havesel = 1;
+		if (!(ss = newselstat(ptab, ptab->hp->path)))
+			return NULL;
+		ptab->cfg.havesel = 1;
 		ptab->ss = ss;
 	}
 	return ss;
 }
 
-static int appendselection(Entry *ent)
+/* Returns the hash slot of name in the selection set, or NULL */
+static struct selslot *findselslot(struct selstat *ss, const char *name, unsigned int h)
+{
+	unsigned int mask = ss->hcap - 1;
+	struct selslot *slot;
+
+	for (unsigned int i = h & mask; (slot = &ss->htab[i])->off != 0; i = (i + 1) & mask)
+		if (slot->hash == h && slot->off != SEL_DEL && strcmp(ss->nbuf + slot->off, name) == 0)
+			return slot;
+	return NULL;
+}
+
+static struct selslot *insertselslot(struct selslot *htab, unsigned int hcap, unsigned int h)
+{
+	unsigned int i = h & (hcap - 1);
+
+	while (htab[i].off != 0)
+		i = (i + 1) & (hcap - 1);
+	htab[i].hash = h;
+	return &htab[i];
+}
+
+/* Drop removed names from nbuf, and rebuild the hash set to fit the remaining ones */
+static int resizeselset(struct selstat *ss)
+{
+	unsigned int cap = SEL_HINIT, mask = ss->hcap - 1, h, i;
+	struct selslot *htab, *slot;
+	char *dst = ss->nbuf;
+
+	while (cap < (ss->nname + 1) * 2)
+		cap <<= 1;
+	htab = calloc(cap, sizeof(struct selslot));
+	if (!htab && seterrnum(__LINE__, errno))
+		return FALSE;
+
+	for (char *pos = ss->nbuf, *next; pos < ss->endp; pos = next) {
+		size_t len = strlen(pos + 1) + 2;
+		next = pos + len;
+		if (*pos == 0)
+			continue;
+
+		// Names ahead of pos are already moved, so match the old slot by offset rather than name
+		h = hashstr(pos + 1);
+		for (i = h & mask; ss->htab[i].off != (unsigned int)(pos + 1 - ss->nbuf); i = (i + 1) & mask)
+			;
+		slot = insertselslot(htab, cap, h);
+		slot->cat = ss->htab[i].cat;
+		slot->size = ss->htab[i].size;
+		slot->off = dst + 1 - ss->nbuf;
+		memmove(dst, pos, len);
+		dst += len;
+	}
+	free(ss->htab);
+	ss->htab = htab;
+	ss->hcap = cap;
+	ss->endp = dst;
+	ss->ndel = 0;
+	return TRUE;
+}
+
+static int selcat(const Entry *ent)
+{
+	if (ent->flag & E_REG_FILE)
+		return 0;
+	return (ent->type == F_DIR) ? 1 : (ent->type == F_LNK || ent->type == F_ORPH) ? 2 : 3;
+}
+
+/* Returns the cache slot of path, or the empty slot where it belongs */
+static struct ducache *findducache(const char *path, unsigned int h)
+{
+	unsigned int mask = ducachecap - 1, i;
+
+	for (i = h & mask; pducache[i].path; i = (i + 1) & mask)
+		if (pducache[i].hash == h && strcmp(pducache[i].path, path) == 0)
+			break;
+	return &pducache[i];
+}
+
+/* Look up the size of a directory, queueing it for the worker if unknown. Returns -1 if not known yet. */
+static off_t getdusize(const char *path)
+{
+	unsigned int h = hashstr(path);
+	struct ducache *dc;
+
+	if ((nducache + 1) * 2 > ducachecap) {
+		unsigned int cap = MAX(64, ducachecap * 2);
+		struct ducache *tmp = pducache, *end = pducache + ducachecap;
+		if (!(pducache = calloc(cap, sizeof(struct ducache))) && seterrnum(__LINE__, errno)) {
+			pducache = tmp;
+			return -1;
+		}
+		ducachecap = cap;
+		for (struct ducache *p = tmp; p < end; ++p)
+			if (p->path)
+				*findducache(p->path, p->hash) = *p;
+		free(tmp);
+	}
+
+	dc = findducache(path, h);
+	if (!dc->path) {
+		if (!(dc->path = strdup(path)) && seterrnum(__LINE__, errno))
+			return -1;
+		dc->hash = h;
+		++nducache;
+	} else if (dc->size >= 0 && time(NULL) - dc->time < DU_TTL)
+		return dc->size;
+	else if (dc->size < 0 && dc->time != 0) // Already queued
+		return -1;
+
+	char **tmp = realloc(pduqueue, (nduqueue + 1) * sizeof(char *));
+	if (!tmp && seterrnum(__LINE__, errno))
+		return -1;
+	pduqueue = tmp;
+	pduqueue[nduqueue++] = dc->path;
+	dc->size = -1;
+	dc->time = 1;
+	return -1;
+}
+
+/* Add name to the selection set ss of tab. nlen includes terminating '\0'. */
+static int addselname(Tabs *tab, struct selstat *ss, const char *name, size_t nlen, int cat, off_t size)
 {
 	size_t len;
-	struct selstat *ss = getselstat();
+	unsigned int h = hashstr(name);
+	struct selslot *slot;
 
-	if (!ss)
+	if (findselslot(ss, name, h))
+		return TRUE;
+	if ((ss->nname + ss->ndel + 1) * 4 > ss->hcap * 3 && !resizeselset(ss))
 		return FALSE;
 
 	len = ss->endp - ss->nbuf;
-	if (ent->nlen >= ss->buflen - len) {
-		char *tmp = realloc(ss->nbuf, ss->buflen += NAME_INCR);
-		if (!tmp && seterrnum(__LINE__, errno)) {
-			ss->buflen -= NAME_INCR;
+	if (nlen + 1 > ss->buflen - len) {
+		size_t buflen = MAX(ss->buflen * 2, len + nlen + 1);
+		char *tmp = realloc(ss->nbuf, buflen);
+		if (!tmp && seterrnum(__LINE__, errno))
 			return FALSE;
-		}
 		ss->nbuf = tmp;
 		ss->endp = len + ss->nbuf;
+		ss->buflen = buflen;
 	}
 
-	memccpy(ss->endp, ent->name, '\0', ent->nlen);
-	ss->endp += ent->nlen;
-	ent->flag |= E_SEL;
-	++ptab->nsel;
-	ptab->cfg.mansel = 1;
+	*ss->endp = 1; // live flag, cleared on removal
+	memcpy(ss->endp + 1, name, nlen);
+	slot = insertselslot(ss->htab, ss->hcap, h);
+	slot->off = len + 1;
+	slot->cat = cat;
+	slot->size = size;
+	ss->endp += nlen + 1;
+	++ss->nname;
+
+	if (slot->cat == 1) {
+		char path[PATH_MAX];
+		makepath(ss->path, name, path);
+		if ((slot->size = getdusize(path)) < 0)
+			++tab->selpend;
+	}
+	if (slot->size > 0)
+		tab->selsize += slot->size;
+	++tab->selcnt[slot->cat];
+	++tab->nsel;
 	return TRUE;
 }
 
-static char *findinbuf(char *buf, size_t len, char *name, int nlen)
+static int appendselection(Entry *ent)
 {
-	char *dst, *src = buf;
+	struct selstat *ss = getselstat();
 
-	for (;;) {
-		dst = memmem(src, len, name, nlen);
-		if (!dst)
-			return NULL;
-		if (dst == buf || dst[-1] == '\0')
-			return dst;
-		src += nlen; // found name as a substring of another name, move forward
-		if (src >= buf + len)
-			return NULL;
-	}
+	if (!ss || !addselname(ptab, ss, ent->name, ent->nlen, selcat(ent), ent->size))
+		return FALSE;
+
+	ent->flag |= E_SEL;
+	ptab->cfg.mansel = 1;
+	return TRUE;
 }
 
 static void removeselection(Entry *ent)
 {
-	char *dst, *src;
+	struct selslot *slot;
 	struct selstat *ss = ptab->ss;
 
 	if (!ss || !ptab->cfg.havesel)
 		return;
 
-	dst = findinbuf(ss->nbuf, ss->endp - ss->nbuf, ent->name, ent->nlen);
-	if (!dst)
+	slot = findselslot(ss, ent->name, hashstr(ent->name));
+	if (!slot)
 		return;
 
-	src = dst + ent->nlen;
-	memmove(dst, src, ss->endp - src);
-	ss->endp -= ent->nlen;
-	if (ss->endp <= ss->nbuf)
+	if (slot->size < 0)
+		--ptab->selpend;
+	else
+		ptab->selsize -= slot->size;
+	--ptab->selcnt[slot->cat];
+
+	ss->nbuf[slot->off - 1] = 0;
+	slot->off = SEL_DEL;
+	--ss->nname;
+	++ss->ndel;
+	if (ss->nname == 0)
 		deleteselstat(ss);
+	else if (ss->ndel > ss->nname && ss->ndel > SEL_HINIT)
+		resizeselset(ss);
 
 	ent->flag &= ~E_SEL;
 	--ptab->nsel;
 }
 
-static int toggleselection(int n)
+static off_t dutotal;
+
+static int dusum(const char *path __attribute__((unused)), const struct stat *sb,
+	int flag __attribute__((unused)), struct FTW *ftw __attribute__((unused)))
+{
+	if (S_ISREG(sb->st_mode))
+		dutotal += sb->st_size;
+	return 0;
+}
+
+/* Returns the slot of a selected directory waiting for its size in tab, or NULL */
+static struct selslot *findduslot(Tabs *tab, const char *path)
+{
+	char dir[PATH_MAX];
+	const char *name = strrchr(path, '/');
+	size_t len = MAX(name - path, 1);
+	struct selstat *ss;
+	struct selslot *slot;
+
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	ss = findselstat(tab, dir);
+	slot = ss ? findselslot(ss, name + 1, hashstr(name + 1)) : NULL;
+	return (slot && slot->size < 0) ? slot : NULL;
+}
+
+/* Compute sizes of queued directories in a child process, results are read back by readduworker */
+static void startduworker(void)
+{
+	int pfd[2], n = 0;
+	pid_t pid;
+
+	if (dufd != -1 || nduqueue == 0)
+		return;
+
+	// Skip directories deselected since they were queued
+	for (int i = 0, t; i < nduqueue; ++i) {
+		for (t = 0; t <= TABS_MAX && !findduslot(&gtab[t], pduqueue[i]); ++t)
+			;
+		if (t <= TABS_MAX)
+			pduqueue[n++] = pduqueue[i];
+		else
+			findducache(pduqueue[i], hashstr(pduqueue[i]))->time = 0;
+	}
+	if ((nduqueue = n) == 0)
+		return;
+
+	if (pipe(pfd) == -1 && seterrnum(__LINE__, errno))
+		return;
+
+	pid = fork();
+	if (pid == 0) {
+		close(pfd[0]);
+		for (int i = 0; i < nduqueue; ++i) {
+			dutotal = 0;
+			nftw(pduqueue[i], dusum, 16, FTW_PHYS | FTW_MOUNT);
+			if (write(pfd[1], &dutotal, sizeof(off_t)) != sizeof(off_t))
+				break;
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pfd[1]);
+	if (pid == -1) {
+		close(pfd[0]);
+		seterrnum(__LINE__, errno);
+		return;
+	}
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	dufd = pfd[0];
+	ndujob = nduqueue;
+}
+
+/* Apply finished directory sizes to the selections of all tabs. Returns GO_STATBAR if any total changed. */
+static int readduworker(void)
+{
+	static int ndone = 0;
+	static size_t carry = 0;
+	static char rbuf[sizeof(off_t) * 64];
+	int changed = FALSE;
+	ssize_t len;
+
+	if (dufd == -1)
+		return GO_NONE;
+
+	while ((len = read(dufd, rbuf + carry, sizeof(rbuf) - carry)) > 0) {
+		len += carry;
+		carry = len % sizeof(off_t);
+		for (char *p = rbuf; p + sizeof(off_t) <= rbuf + len && ndone < ndujob; p += sizeof(off_t), ++ndone) {
+			const char *path = pduqueue[ndone];
+			struct ducache *dc = findducache(path, hashstr(path));
+			off_t size;
+
+			memcpy(&size, p, sizeof(off_t));
+			dc->size = size;
+			dc->time = time(NULL);
+			for (int i = 0; i <= TABS_MAX; ++i) {
+				struct selslot *slot = findduslot(&gtab[i], path);
+				if (slot) {
+					slot->size = size;
+					gtab[i].selsize += size;
+					--gtab[i].selpend;
+					changed = TRUE;
+				}
+			}
+		}
+		memmove(rbuf, rbuf + len - carry, carry);
+	}
+
+	if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+		if (ndone < ndujob) { // Worker died on this one: count it as empty, and give the rest to a new worker
+			const char *path = pduqueue[ndone++];
+			findducache(path, hashstr(path))->time = 0;
+			for (int i = 0; i <= TABS_MAX; ++i) {
+				struct selslot *slot = findduslot(&gtab[i], path);
+				if (slot) {
+					slot->size = 0;
+					--gtab[i].selpend;
+					changed = TRUE;
+				}
+			}
+		}
+		close(dufd);
+		dufd = -1;
+		nduqueue -= ndone;
+		memmove(pduqueue, pduqueue + ndone, nduqueue * sizeof(char *));
+		ndone = ndujob = 0;
+		carry = 0;
+		startduworker();
+	}
+	return changed ? GO_STATBAR : GO_NONE;
+}
+
+/* Returns the cache slot of key, or the empty slot where it belongs */
+static struct idname *findidname(unsigned long long key)
+{
+	unsigned int mask = idcachecap - 1, i;
+
+	for (i = (unsigned int)(key * 2654435761u) & mask; pidcache[i].key != 0; i = (i + 1) & mask)
+		if (pidcache[i].key == key)
+			break;
+	return &pidcache[i];
+}
+
+static struct idname *addidname(unsigned long long key)
+{
+	struct idname *in;
+
+	if ((nidcache + 1) * 2 > idcachecap) {
+		unsigned int cap = MAX(256, idcachecap * 2);
+		struct idname *tmp = pidcache, *end = pidcache + idcachecap;
+		if (!(pidcache = calloc(cap, sizeof(struct idname))) && seterrnum(__LINE__, errno)) {
+			pidcache = tmp;
+			return NULL;
+		}
+		idcachecap = cap;
+		for (struct idname *p = tmp; p < end; ++p)
+			if (p->key != 0)
+				*findidname(p->key) = *p;
+		free(tmp);
+	}
+
+	in = findidname(key);
+	if (in->key == 0) {
+		in->key = key;
+		++nidcache;
+	}
+	return in;
+}
+
+/* Fill the cache from the local passwd and group files, so only other ids need a lookup */
+static void loadidnames(const char *file, unsigned long long gflag)
+{
+	FILE *fp = fopen(file, "re");
+	char *line = NULL, *id;
+	size_t len = 0;
+	time_t now = time(NULL);
+
+	if (!fp)
+		return;
+	while (getline(&line, &len, fp) > 0) {
+		char *end = strchr(line, ':');
+		if (!end || !(id = strchr(end + 1, ':')) || !isdigit(id[1]))
+			continue;
+		*end = '\0';
+		struct idname *in = addidname(gflag | ((unsigned long long)strtoul(id + 1, NULL, 10) + 1));
+		if (!in)
+			break;
+		if (in->time == 0) { // Keep the first name of an id
+			memccpy(in->name, line, '\0', sizeof(in->name) - 1);
+			in->time = now;
+		}
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void loadlocalids(void)
+{
+	static int loaded = FALSE;
+
+	if (!loaded) {
+		loaded = TRUE;
+		loadidnames("/etc/passwd", 0);
+		loadidnames("/etc/group", 1ULL << 33);
+	}
+}
+
+/* Returns the name of a user or group id from the cache. Unknown and expired ids are
+   queued for the id worker, and shown as numbers until resolved. */
+static char *getidname(unsigned int id, int isgrp)
+{
+	unsigned long long key = ((unsigned long long)isgrp << 33) | ((unsigned long long)id + 1); // never 0
+	struct idname *in;
+
+	loadlocalids();
+	in = idcachecap ? findidname(key) : NULL;
+	if (!in || in->key == 0 || (!in->pending && time(NULL) - in->time >= IDNAME_TTL)) {
+		unsigned long long *tmp;
+		if ((in = addidname(key)) && !in->pending
+		&& (tmp = realloc(pidqueue, (nidqueue + 1) * sizeof(unsigned long long)))) {
+			pidqueue = tmp;
+			pidqueue[nidqueue++] = key;
+			in->pending = TRUE;
+		}
+	}
+	return (in && in->name[0]) ? in->name : xitoa(id);
+}
+
+/* Returns the id of a user or group name known to the cache, or -1. Names of the owners of
+   listed files are in it, so this never waits on the name service. */
+static long long findidbyname(const char *name, int isgrp)
+{
+	loadlocalids();
+	for (unsigned int i = 0; i < idcachecap; ++i)
+		if (pidcache[i].key != 0 && (int)(pidcache[i].key >> 33) == isgrp && strcmp(pidcache[i].name, name) == 0)
+			return (long long)(pidcache[i].key & ((1ULL << 33) - 1)) - 1;
+	return -1;
+}
+
+static char *getpwname(uid_t uid)
+{
+	return getidname(uid, FALSE);
+}
+
+static char *getgrname(gid_t gid)
+{
+	return getidname(gid, TRUE);
+}
+
+/* Look up queued ids in a child process, so slow name services don't block drawing */
+static void startidworker(void)
+{
+	int pfd[2];
+	pid_t pid;
+
+	if (idfd != -1 || nidqueue == 0)
+		return;
+	if (pipe(pfd) == -1 && seterrnum(__LINE__, errno))
+		return;
+
+	pid = fork();
+	if (pid == 0) {
+		struct idname in = {0};
+		close(pfd[0]);
+		for (int i = 0; i < nidqueue; ++i) {
+			unsigned int id = (unsigned int)((pidqueue[i] & 0x1ffffffffULL) - 1);
+			const char *name = NULL;
+			if (pidqueue[i] >> 33) {
+				struct group *gr = getgrgid(id);
+				name = gr ? gr->gr_name : NULL;
+			} else {
+				struct passwd *pw = getpwuid(id);
+				name = pw ? pw->pw_name : NULL;
+			}
+			in.key = pidqueue[i];
+			memset(in.name, 0, sizeof(in.name));
+			if (name)
+				memccpy(in.name, name, '\0', sizeof(in.name) - 1);
+			if (write(pfd[1], &in, sizeof(in)) != sizeof(in))
+				break;
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pfd[1]);
+	if (pid == -1) {
+		close(pfd[0]);
+		seterrnum(__LINE__, errno);
+		return;
+	}
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	idfd = pfd[0];
+	nidjob = nidqueue;
+}
+
+/* Store names resolved by the id worker. Returns GO_REDRAW if any were read. */
+static int readidworker(void)
+{
+	static size_t carry = 0;
+	static struct idname rbuf[16];
+	int changed = FALSE;
+	ssize_t len;
+
+	if (idfd == -1)
+		return GO_NONE;
+
+	while ((len = read(idfd, (char *)rbuf + carry, sizeof(rbuf) - carry)) > 0) {
+		len += carry;
+		carry = len % sizeof(struct idname);
+		for (struct idname *p = rbuf; p < rbuf + len / sizeof(struct idname); ++p) {
+			struct idname *in = findidname(p->key);
+			if (in->key == 0)
+				continue;
+			memcpy(in->name, p->name, sizeof(in->name));
+			in->time = time(NULL);
+			in->pending = FALSE;
+			changed = TRUE;
+		}
+		memmove(rbuf, (char *)rbuf + len - carry, carry);
+	}
+
+	if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+		for (int i = 0; i < nidjob; ++i) { // Let ids the worker didn't answer be queued again
+			struct idname *in = findidname(pidqueue[i]);
+			if (in->key != 0 && in->pending) {
+				in->pending = FALSE;
+				in->time = 0;
+			}
+		}
+		close(idfd);
+		idfd = -1;
+		nidqueue -= nidjob;
+		memmove(pidqueue, pidqueue + nidjob, nidqueue * sizeof(unsigned long long));
+		nidjob = 0;
+		carry = 0;
+		startidworker();
+	}
+	return changed ? GO_REDRAW : GO_NONE;
+}
+
+/* Follow the pending symlinks of the listing in a child process, so that a large one
+   need not wait for all of them to be sorted. Each listing is followed once. */
+static void startlnkworker(void)
+{
+	int pfd[2];
+	pid_t pid;
+
+	if (lnkfd != -1 || lnkgen == loadgen)
+		return;
+	if (pipe(pfd) == -1 && seterrnum(__LINE__, errno))
+		return;
+
+	pid = fork();
+	if (pid == 0) {
+		struct lnkres buf[512];
+		size_t n = 0;
+		close(pfd[0]);
+		for (int i = 0; i < ptab->nde; ++i) {
+			if (!(pdents[i].flag & E_LNK_PEND))
+				continue;
+			buf[n].off = pdents[i].name - pnamebuf;
+			buf[n].res = followlink(pdents[i].name);
+			if (++n == LENGTH(buf)) {
+				if (!writeall(pfd[1], (char *)buf, n * sizeof(*buf)))
+					break;
+				n = 0;
+			}
+		}
+		writeall(pfd[1], (char *)buf, n * sizeof(*buf));
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pfd[1]);
+	if (pid == -1) {
+		close(pfd[0]);
+		seterrnum(__LINE__, errno);
+		return;
+	}
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	lnkfd = pfd[0];
+	lnkgen = loadgen;
+	lnkreslen = 0;
+}
+
+static int lnkrescmp(const void *a, const void *b)
+{
+	unsigned int x = ((const struct lnkres *)a)->off, y = ((const struct lnkres *)b)->off;
+	return (x > y) - (x < y);
+}
+
+/* Collect what the link worker found. When it is done, mark the links of the listing it
+   followed, and sort the listing again if it is still shown. */
+static int readlnkworker(void)
+{
+	struct lnkres *res, key;
+	size_t n;
+	ssize_t len = -1;
+
+	if (lnkfd == -1)
+		return GO_NONE;
+
+	for (;;) {
+		if (lnkreslen == lnkrescap) {
+			size_t cap = MAX(lnkrescap * 2, 512 * sizeof(struct lnkres));
+			char *tmp = realloc(plnkres, cap);
+			if (!tmp) // The links not read yet are followed when shown
+				break;
+			plnkres = (struct lnkres *)tmp;
+			lnkrescap = cap;
+		}
+		if ((len = read(lnkfd, (char *)plnkres + lnkreslen, lnkrescap - lnkreslen)) <= 0)
+			break;
+		lnkreslen += len;
+	}
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return GO_NONE;
+
+	close(lnkfd);
+	lnkfd = -1;
+	if (lnkgen != loadgen) // Another listing was loaded meanwhile, sorting it starts a worker for it
+		return refreshview(2);
+	n = lnkreslen / sizeof(struct lnkres);
+	qsort(plnkres, n, sizeof(struct lnkres), lnkrescmp);
+	for (int i = 0; i < ptab->nde; ++i) {
+		if (!(pdents[i].flag & E_LNK_PEND))
+			continue;
+		key.off = pdents[i].name - pnamebuf;
+		if ((res = bsearch(&key, plnkres, n, sizeof(struct lnkres), lnkrescmp)))
+			setlink(&pdents[i], res->res);
+	}
+	return refreshview(2);
+}
+
+static int toggleselection(int n)
 {
 	if (ndents == 0)
 		return GO_NONE;
@@ -902,23 +2086,14 @@ static int selectall(int n __attribute__((unused)))
 
 static int invertselection(int n __attribute__((unused)))
 {
-	struct selstat *ss = getselstat();
 	int mansel = ptab->cfg.mansel;
 
-	if (!ss)
-		return GO_STATBAR;
-
-	ss->endp = ss->nbuf;
 	for (int i = 0; i < ndents; ++i) {
-		if (pdents[i].flag & E_SEL) {
-			pdents[i].flag &= ~E_SEL;
-			--ptab->nsel;
-		} else if (i != cursel || mansel)
+		if (pdents[i].flag & E_SEL)
+			removeselection(&pdents[i]);
+		else if (i != cursel || mansel)
 			appendselection(&pdents[i]);
 	}
-
-	if (ss->endp == ss->nbuf)
-		deleteselstat(ss);
 	return GO_REDRAW;
 }
 
@@ -953,8 +2128,7 @@ static int selectrange(int n)
 
 static int clearselection(int n __attribute__((unused)))
 {
-	deleteallselstat(ptab->ss);
-	ptab->ss = NULL;
+	deleteallselstat(ptab);
 	ptab->nsel = 0;
 	ptab->cfg.havesel = 0;
 	ptab->cfg.mansel = 0;
@@ -998,28 +2172,211 @@ static int quickfind(int n __attribute__((unused)))
 	return GO_REDRAW;
 }
 
+/* Invalidate indexes of the listing after entries are reloaded, filtered or sorted */
+static void resetindex(void)
+{
+	nfoldidx = nhitidx = nnameidx = -1;
+}
+
+/* Returns the position of the entry with the given name among all loaded entries (filtered
+   out ones included), or -1. Uses a lazily built open addressing table of (hash, index + 1). */
+static int findentry(const char *name)
+{
+	unsigned int h = hashstr(name), mask, i;
+
+	if (nnameidx != ptab->nde) {
+		unsigned int cap = 16;
+		while (cap < (unsigned int)ptab->nde * 2)
+			cap <<= 1;
+		if (cap > nameidxcap) {
+			unsigned int *tmp = realloc(pnameidx, cap * 2 * sizeof(unsigned int));
+			if (!tmp && seterrnum(__LINE__, errno)) {
+				for (int j = 0; j < ptab->nde; ++j)
+					if (strcmp(name, pdents[j].name) == 0)
+						return j;
+				return -1;
+			}
+			pnameidx = tmp;
+			nameidxcap = cap;
+		}
+		memset(pnameidx, 0, nameidxcap * 2 * sizeof(unsigned int));
+
+		mask = nameidxcap - 1;
+		for (int j = 0; j < ptab->nde; ++j) {
+			unsigned int hj = hashstr(pdents[j].name);
+			for (i = hj & mask; pnameidx[i * 2 + 1] != 0; i = (i + 1) & mask)
+				;
+			pnameidx[i * 2] = hj;
+			pnameidx[i * 2 + 1] = j + 1;
+		}
+		nnameidx = ptab->nde;
+	}
+
+	mask = nameidxcap - 1;
+	for (i = h & mask; pnameidx[i * 2 + 1] != 0; i = (i + 1) & mask)
+		if (pnameidx[i * 2] == h && strcmp(name, pdents[pnameidx[i * 2 + 1] - 1].name) == 0)
+			return pnameidx[i * 2 + 1] - 1;
+	return -1;
+}
+
+static int foldidxcmp(const void *va, const void *vb)
+{
+	return strcasecmp(pdents[*(const int *)va].name, pdents[*(const int *)vb].name);
+}
+
+/* Build the table of lowest positions over blocks of FOLD_BLOCK entries of the quick find index.
+   Without it, foldmin() scans. */
+static void buildfoldmin(void)
+{
+	int *tmp;
+
+	nfoldblk = (ndents + FOLD_BLOCK - 1) / FOLD_BLOCK;
+	for (nfoldlvl = 1; (1 << nfoldlvl) <= nfoldblk; ++nfoldlvl)
+		;
+	if (!(tmp = realloc(pfoldmin, MAX(1, nfoldblk * nfoldlvl) * sizeof(int)))) {
+		nfoldlvl = 0;
+		return;
+	}
+	pfoldmin = tmp;
+
+	for (int b = 0; b < nfoldblk; ++b) {
+		int m = INT_MAX;
+		for (int i = b * FOLD_BLOCK; i < MIN(ndents, (b + 1) * FOLD_BLOCK); ++i)
+			m = MIN(m, pfoldidx[i]);
+		pfoldmin[b] = m;
+	}
+	for (int k = 1; k < nfoldlvl; ++k)
+		for (int b = 0; b + (1 << k) <= nfoldblk; ++b)
+			pfoldmin[k * nfoldblk + b] = MIN(pfoldmin[(k - 1) * nfoldblk + b],
+			                                 pfoldmin[(k - 1) * nfoldblk + b + (1 << (k - 1))]);
+}
+
+/* Returns the lowest position in the listing among entries lo to hi - 1 of the quick find index:
+   the partial blocks at the ends are scanned, the whole ones between are two lookups. */
+static int foldmin(int lo, int hi)
+{
+	int res = INT_MAX, bl = (lo + FOLD_BLOCK - 1) / FOLD_BLOCK, bh = hi / FOLD_BLOCK, k = 0;
+
+	if (nfoldlvl == 0 || bl >= bh) {
+		for (; lo < hi; ++lo)
+			res = MIN(res, pfoldidx[lo]);
+		return res;
+	}
+	for (int i = lo; i < bl * FOLD_BLOCK; ++i)
+		res = MIN(res, pfoldidx[i]);
+	for (int i = bh * FOLD_BLOCK; i < hi; ++i)
+		res = MIN(res, pfoldidx[i]);
+	while ((2 << k) <= bh - bl)
+		++k;
+	return MIN(res, MIN(pfoldmin[k * nfoldblk + bl], pfoldmin[k * nfoldblk + bh - (1 << k)]));
+}
+
+/* Returns the first entry whose name starts with str (case-insensitive), or -1.
+   Binary searches for the range of matches in a lazily built index of entries sorted
+   by case-folded name, then takes the lowest position in it. */
+static int findprefix(const char *str, size_t len)
+{
+	int lo = 0, hi = ndents, mid, first;
+
+	if (nfoldidx != ndents) {
+		int *tmp = realloc(pfoldidx, MAX(1, ndents) * sizeof(int));
+		if (!tmp && seterrnum(__LINE__, errno)) {
+			for (int i = 0; i < ndents; ++i)
+				if (strncasecmp(pdents[i].name, str, len) == 0)
+					return i;
+			return -1;
+		}
+		pfoldidx = tmp;
+		for (int i = 0; i < ndents; ++i)
+			pfoldidx[i] = i;
+		qsort(pfoldidx, ndents, sizeof(int), foldidxcmp);
+		buildfoldmin();
+		nfoldidx = ndents;
+	}
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (strncasecmp(pdents[pfoldidx[mid]].name, str, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	for (hi = ndents; lo < hi; ) {
+		mid = (lo + hi) >> 1;
+		if (strncasecmp(pdents[pfoldidx[mid]].name, str, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (first < lo) ? foldmin(first, lo) : -1;
+}
+
+/* Cache the entries whose names contain the quick find string. Extending the string only rescans previous hits. */
+static int gethits(void)
+{
+	size_t len = strlen(hitstr);
+	int n = 0;
+
+	if (nhitidx >= 0 && strcmp(hitstr, ptab->find) == 0)
+		return TRUE;
+
+	if (nhitidx >= 0 && strncmp(hitstr, ptab->find, len) == 0) {
+		for (int i = 0; i < nhitidx; ++i)
+			if (strcasestr(pdents[phitidx[i]].name, ptab->find))
+				phitidx[n++] = phitidx[i];
+	} else {
+		int *tmp = realloc(phitidx, MAX(1, ndents) * sizeof(int));
+		if (!tmp && seterrnum(__LINE__, errno))
+			return FALSE;
+		phitidx = tmp;
+		for (int i = 0; i < ndents; ++i)
+			if (strcasestr(pdents[i].name, ptab->find))
+				phitidx[n++] = i;
+	}
+
+	nhitidx = n;
+	curhit = 0;
+	memccpy(hitstr, ptab->find, '\0', FILT_MAX);
+	return TRUE;
+}
+
 static int qfindnext(int n)
 {
-	int sta = (n == 0) ? 0 : cursel + n;
+	int i = -1, lo = 0, hi;
 
 	if (ptab->fdlen == 0 || ptab->find[0] == '\0')
 		return GO_NONE;
 
-	n = (n == 0) ? 1 : n;
-	for (int i = sta; i >= 0 && i < ndents; i += n) {
-		if (strcasestr(pdents[i].name, ptab->find)) {
-			cursel = i;
-			curscroll = MAX(i - (onscr * 3 >> 2), MIN(i - (onscr >> 2), curscroll));
-			return GO_REDRAW;
+	if (!gethits()) {
+		int sta = (n == 0) ? 0 : cursel + n;
+		for (i = sta, n = (n == 0) ? 1 : n; i >= 0 && i < ndents && !strcasestr(pdents[i].name, ptab->find); i += n)
+			;
+	} else if (nhitidx > 0) {
+		if (n == 0)
+			curhit = -1;
+		else if (curhit >= nhitidx || phitidx[curhit] != cursel) { // cursor moved, search from it
+			for (hi = nhitidx; lo < hi; ) // count hits before cursor (or at it when moving forward)
+				if (phitidx[(lo + hi) >> 1] < cursel + (n > 0))
+					lo = ((lo + hi) >> 1) + 1;
+				else
+					hi = (lo + hi) >> 1;
+			curhit = (n > 0) ? lo - 1 : lo; // the next step lands on the nearest hit
 		}
+		if (curhit + (n ? n : 1) >= 0 && curhit + (n ? n : 1) < nhitidx)
+			i = phitidx[curhit += (n ? n : 1)];
+	}
+
+	if (i >= 0 && i < ndents) {
+		cursel = i;
+		curscroll = MAX(i - (onscr * 3 >> 2), MIN(i - (onscr >> 2), curscroll));
 	}
 	return GO_REDRAW;
 }
 
 static int inittab(const char *path, int n)
 {
-	deleteallselstat(gtab[n].ss);
-	gtab[n].ss = NULL;
+	deleteallselstat(&gtab[n]);
 
 	gtab[n].hp = inithistpath(&ghpath[n * 2], path);
 	if (!gtab[n].hp)
@@ -1029,6 +2386,7 @@ static int inittab(const char *path, int n)
 		gtab[n].hp->stat->flag = S_ROOT;
 
 	gtab[n].ftlen = gtab[n].fdlen = 0;
+	gtab[n].ftmode = FM_SUBSTR;
 	gtab[n].nde = gtab[n].nsel = 0;
 	gtab[n].cfg = gcfg;
 	gtab[n].cfg.enabled = 1;
@@ -1050,11 +2408,21 @@ static int switchtab(int n)
 	if (gcfg.ct < TABS_MAX)
 		gcfg.lt = gcfg.ct;
 	gcfg.ct = n;
-	if (chdir(gtab[n].hp->path) == -1)
+	if (changedir(gtab[n].hp->path) == -1)
 		seterrnum(__LINE__, errno);
 	return GO_RELOAD;
 }
 
+/* Stop reading streamed search results. The producer ends with SIGPIPE on its next write. */
+static void cancelfind(void)
+{
+	if (findfd != -1) {
+		close(findfd);
+		findfd = -1;
+	}
+	settimer(T_FINDLOAD, -1);
+}
+
 static int closetab(int n __attribute__((unused)))
 {
 	int ct = gcfg.ct, lt = -1;
@@ -1069,33 +2437,50 @@ static int closetab(int n __attribute__((unused)))
 	if (lt == -1) {
 		if (ct == 0)
 			return GO_NONE;
-		if (!inittab(home ? home : "/", 0) || (chdir(home ? home : "/") == -1 && seterrnum(__LINE__, errno)))
+		if (!inittab(home ? home : "/", 0) || (changedir(home ? home : "/") == -1 && seterrnum(__LINE__, errno)))
 			return GO_STATBAR;
 		gcfg.ct = 0;
 	} else {
-		if (chdir(gtab[lt].hp->path) == -1)
+		if (changedir(gtab[lt].hp->path) == -1)
 			seterrnum(__LINE__, errno);
 		gcfg.ct = lt;
 	}
 
 	if (ct == TABS_MAX) {
+		cancelfind();
 		free(pfindbuf);
 		pfindbuf = pfindend = NULL;
+		findlen = findcap = 0;
 	} else
 		gcfg.lt = ct;
 
-	deleteallselstat(gtab[ct].ss);
-	gtab[ct].ss = NULL;
+	deleteallselstat(&gtab[ct]);
 	gtab[ct].cfg.enabled = 0;
 	return GO_RELOAD;
 }
 
 static int togglemode(int n __attribute__((unused)))
 {
+	char path[PATH_MAX];
+
 	if (gcfg.runmode == 2)
 		return GO_NONE;
 	gcfg.runmode ^= 1;
-	return GO_FASTDRAW;
+	if (gcfg.runmode == 1)
+		return GO_FASTDRAW;
+
+	stophelper();
+	if (!hlpcwd)
+		return GO_FASTDRAW;
+	// The directory was only browsed as root, go up to one the user can enter
+	memccpy(path, ptab->hp->path, '\0', PATH_MAX);
+	while (chdir(path) == -1 && strcmp(path, "/") != 0)
+		xdirname(path);
+	hlpcwd = FALSE;
+	if (newhistpath(path, TRUE) == GO_STATBAR)
+		return GO_STATBAR;
+	seterrnum(__LINE__, EACCES);
+	return GO_RELOAD;
 }
 
 static int getinput(WINDOW *w)
@@ -1297,6 +2682,7 @@ static void usage(void)
 		" -m        mix directories and files when sorting\n"
 		" -o        open files on right arrow or 'l' key\n"
 		" -p        show permissions as symbolic strings\n"
+		" -s        restore the last session, and save it on exit\n"
 		" -h        display this help and exit\n");
 }
 
@@ -1413,6 +2799,17 @@ static int reventrycmp(const void *va, const void *vb)
 	return -entrycmp(va, vb);
 }
 
+static int scoreentrycmp(const void *va, const void *vb)
+{
+	const Entry *pa = (Entry *)va, *pb = (Entry *)vb;
+
+	if (pa->misc != pb->misc)
+		return (int)pb->misc - (int)pa->misc;
+	if (pa->nlen != pb->nlen) // shorter names first on equal score
+		return (int)pa->nlen - (int)pb->nlen;
+	return entrycmp(va, vb);
+}
+
 static void setpreview(int op)
 {
 	static int fd = -1;
@@ -1451,61 +2848,787 @@ static void setpreview(int op)
 
 static int writeselection(int fd)
 {
-	ssize_t len;
+	size_t len = 0;
 	struct selstat *ss;
+	char *buf;
 	int selcur = !ptab->cfg.mansel && ndents > 0;
 
 	if (selcur && !appendselection(&pdents[cursel]))
 		return FALSE;
 
+	buf = malloc(SEL_WBUF);
+	if (!buf && seterrnum(__LINE__, errno))
+		return FALSE;
+
 	ss = ptab->ss;
 	while (ss && ss->prev)
 		ss = ss->prev;
 
+	// Build paths in place, flush only when the next one may not fit
 	while (ss && errline == 0) {
-		for (char *pos = ss->nbuf, *end; pos < ss->endp && (end = memchr(pos, '\0', PATH_MAX)); pos = end + 1) {
-			len = makepath(ss->path, pos, gpbuf);
-			if (write(fd, gpbuf, len) != len && seterrnum(__LINE__, errno))
-				break;
+		for (char *pos = ss->nbuf, *end; pos < ss->endp && (end = memchr(pos + 1, '\0', PATH_MAX)); pos = end + 1) {
+			if (*pos == 0) // removed name
+				continue;
+			if (SEL_WBUF - len < PATH_MAX) {
+				if (!writeall(fd, buf, len) && seterrnum(__LINE__, errno))
+					break;
+				len = 0;
+			}
+			len += makepath(ss->path, pos + 1, buf + len);
 		}
 		ss = ss->next;
 	}
+	if (errline == 0 && len > 0 && !writeall(fd, buf, len))
+		seterrnum(__LINE__, errno);
+	free(buf);
 
 	if (selcur)
 		clearselection(0);
 	return (errline == 0) ? TRUE : FALSE;
 }
 
-static int readfindresult(int fd)
+#ifdef __APPLE__
+#define STVNSEC(X)  X##timespec.tv_nsec
+#else
+#define STVNSEC(X)  X##tim.tv_nsec
+#endif
+
+/*
+ * Copy engine. A child process walks the sources with openat() and fdopendir(), makes the
+ * directories, links and special files itself, and hands regular files to COPY_JOBS workers
+ * over a datagram socket, one "src\0dst\0" per datagram and an empty one to stop. All of them
+ * report to sff through a pipe of struct cpmsg, read by readcopy(), each a pair of messages every
+ * CP_REPORT ms with what it has found and done since. Directory modes and times
+ * are set last, since copying into a directory changes them.
+ *
+ * Moves are renames done by the walker. Only a source on another filesystem is copied as
+ * above, each file removed once its copy is complete, and its directories at the end.
+ *
+ * Deletes, chmod and chown work on whole directories instead: the coordinator hands them to
+ * the workers over the same socket, and the workers send back the subdirectories they find,
+ * so that idle workers pick up the subtrees of busy ones. A directory is done when an empty
+ * datagram comes back. Directories that must wait for their contents are done last.
+ */
+struct cpmsg {
+	int found; // Files found, or files done
+	int err; // errno of a failed file
+	unsigned int files;
+	off_t bytes;
+};
+
+static struct {
+	int sock, out, kind, mode; // See startcopy
+	unsigned int nfound, ndone, ndir; // nfound, ndone, bfound, bdone and err: not reported yet
+	off_t bfound, bdone;
+	int err; // First failure
+	long long due; // Time of the next report
+	struct cpdir { struct stat sb; char *path, *src; int meta; } *dirs; // src: removed after a move
+	uid_t uid; // chown, -1 to keep
+	gid_t gid;
+	int nmodeop; // chmod
+	struct modeop { mode_t who, perm; char op, from; } modeop[MODEOP_MAX]; // from: 'X', or 'u', 'g', 'o' to copy
+} cpw = {-1, -1, 'c', 'f', 0, 0, 0, 0, 0, 0, 0, NULL, (uid_t)-1, (gid_t)-1, 0, {{0}}};
+
+/* Note a failure, of files that count as done */
+static void cpfail(int err, unsigned int files)
 {
-	ssize_t len = 1;
-	size_t buflen = 0, reslen = 0;
+	if (!cpw.err)
+		cpw.err = err;
+	cpw.ndone += files;
+}
 
-	while (len > 0) {
-		if (buflen - reslen < NAME_INCR) {
-			char *tmp = realloc(pfindbuf, buflen += NAME_INCR);
-			if (!tmp && seterrnum(__LINE__, errno)) {
-				len = -1;
-				break;
+/* Report the files found and done since the last report, at most every CP_REPORT ms unless last.
+   The pipe does not block: while sff waits for an extension function the counts add up here
+   instead of stalling the job. The last report of a process waits for room. */
+static void cpflush(int last)
+{
+	struct cpmsg m[2] = {{TRUE, 0, cpw.nfound, cpw.bfound}, {FALSE, cpw.err, cpw.ndone, cpw.bdone}};
+	struct pollfd pfd = {cpw.out, POLLOUT, 0};
+	long long now = monotime();
+
+	if ((!last && now < cpw.due) || (!cpw.nfound && !cpw.ndone && !cpw.bdone && !cpw.err))
+		return;
+	cpw.due = now + CP_REPORT;
+	while (write(cpw.out, (char *)m, sizeof(m)) == -1) { // Atomic, the size is under PIPE_BUF
+		if (!last || (errno != EINTR && (errno != EAGAIN || (poll(&pfd, 1, -1) == -1 && errno != EINTR))))
+			return;
+	}
+	cpw.nfound = cpw.ndone = 0;
+	cpw.bfound = cpw.bdone = 0;
+	cpw.err = 0;
+}
+
+/* Give dst the owner, mode and times of sb like cp -a. An owner that cannot be set is left as it is. */
+static int copymeta(int fd, const char *dst, const struct stat *sb)
+{
+	struct timespec ts[2] = {{sb->st_atime, sb->STVNSEC(st_a)}, {sb->st_mtime, sb->STVNSEC(st_m)}};
+
+	if (fd != -1) {
+		if ((fchown(fd, sb->st_uid, sb->st_gid) == -1 && errno != EPERM)
+		|| fchmod(fd, sb->st_mode & 07777) == -1 || futimens(fd, ts) == -1)
+			return errno;
+		return 0;
+	}
+	if ((lchown(dst, sb->st_uid, sb->st_gid) == -1 && errno != EPERM)
+	|| (!S_ISLNK(sb->st_mode) && chmod(dst, sb->st_mode & 07777) == -1)
+	|| utimensat(AT_FDCWD, dst, ts, AT_SYMLINK_NOFOLLOW) == -1)
+		return errno;
+	return 0;
+}
+
+/* Copy the rest of sfd to dfd: a reflink where the filesystem shares extents, then in the kernel, then by hand */
+static int copydata(int sfd, int dfd)
+{
+	static char buf[131072];
+	ssize_t n = 0;
+
+#ifdef FICLONE
+	struct stat sb;
+	if (ioctl(dfd, FICLONE, sfd) == 0) {
+		if (fstat(sfd, &sb) == 0)
+			cpw.bdone += sb.st_size;
+		return 0;
+	}
+#endif
+#ifdef __linux__
+	// In the kernel: copy_file_range() lets filesystems copy on their own, sendfile() works across them
+	while ((n = copy_file_range(sfd, NULL, dfd, NULL, CP_CHUNK, 0)) > 0) {
+		cpw.bdone += n;
+		cpflush(FALSE);
+	}
+	if (n == -1) {
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+			return errno;
+		while ((n = sendfile(dfd, sfd, NULL, CP_CHUNK)) > 0) {
+			cpw.bdone += n;
+			cpflush(FALSE);
+		}
+		if (n == -1 && errno != EINVAL && errno != ENOSYS)
+			return errno;
+	}
+#endif
+	while ((n = read(sfd, buf, sizeof(buf))) > 0) {
+		if (!writeall(dfd, buf, n))
+			return errno;
+		cpw.bdone += n;
+		cpflush(FALSE);
+	}
+	return (n == -1) ? errno : 0;
+}
+
+/* Copy a regular file in a worker. An existing target is truncated, or replaced if it cannot be opened, as cp -f does. */
+static void copyfile(const char *src, const char *dst)
+{
+	struct stat sb;
+	int sfd, dfd = -1, err = 0;
+
+	if ((sfd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1 || fstat(sfd, &sb) == -1)
+		err = errno;
+	else if ((dfd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) == -1) {
+		if (errno == EEXIST && cpw.mode == 'f'
+		&& (dfd = open(dst, O_WRONLY | O_TRUNC | O_NOFOLLOW | O_CLOEXEC)) == -1 && unlink(dst) == 0)
+			dfd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (dfd == -1 && (errno != EEXIST || cpw.mode == 'f'))
+			err = errno;
+	}
+
+	if (dfd != -1) {
+		if (!(err = copydata(sfd, dfd)))
+			err = copymeta(dfd, dst, &sb);
+		if (close(dfd) == -1 && !err)
+			err = errno;
+		if (!err && cpw.kind == 'm' && unlink(src) == -1)
+			err = errno;
+	}
+	if (sfd != -1)
+		close(sfd);
+	if (err)
+		cpfail(err, 1);
+	else
+		++cpw.ndone;
+	cpflush(FALSE);
+}
+
+static void copyworker(void)
+{
+	char buf[PATH_MAX * 2];
+
+	while (recv(cpw.sock, buf, sizeof(buf), 0) > 0)
+		copyfile(buf, buf + strlen(buf) + 1);
+	cpflush(TRUE);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Copy name in directory sdir to dst in the walker. src and dst are full paths, extended for the entries of directories. */
+static void copywalk(int sdir, const char *name, char *src, size_t slen, char *dst, size_t dlen)
+{
+	struct stat sb, db;
+	int exists, err = 0;
+
+	if (fstatat(sdir, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+		cpfail(errno, 0);
+		return;
+	}
+	exists = (lstat(dst, &db) == 0);
+	if (exists && db.st_dev == sb.st_dev && db.st_ino == sb.st_ino) { // cp refuses as well
+		cpfail(EEXIST, 0);
+		return;
+	}
+	if (exists && cpw.mode == 'n' && !(S_ISDIR(sb.st_mode) && S_ISDIR(db.st_mode)))
+		return;
+
+	if (S_ISREG(sb.st_mode)) {
+		char buf[PATH_MAX * 2];
+		memcpy(buf, src, slen + 1);
+		memcpy(buf + slen + 1, dst, dlen + 1);
+		if (send(cpw.sock, buf, slen + dlen + 2, 0) == -1) {
+			cpfail(errno, 0);
+			return;
+		}
+		++cpw.nfound;
+		cpw.bfound += sb.st_size;
+		return;
+	}
+
+	if (S_ISDIR(sb.st_mode)) {
+		struct dirent *dp;
+		DIR *dirp;
+		int fd;
+
+		if (exists && !S_ISDIR(db.st_mode)) {
+			cpfail(ENOTDIR, 0);
+			return;
+		}
+		if (!exists && mkdir(dst, 0700) == -1) { // Writable until its own mode is set at the end
+			cpfail(errno, 0);
+			return;
+		}
+		if (!exists || cpw.mode == 'f' || cpw.kind == 'm') {
+			struct cpdir *tmp = realloc(cpw.dirs, (cpw.ndir + 1) * sizeof(struct cpdir));
+			if (tmp) {
+				cpw.dirs = tmp;
+				tmp[cpw.ndir].sb = sb;
+				tmp[cpw.ndir].meta = (!exists || cpw.mode == 'f');
+				tmp[cpw.ndir].src = (cpw.kind == 'm') ? strdup(src) : NULL;
+				if ((tmp[cpw.ndir].path = strdup(dst)))
+					++cpw.ndir;
 			}
-			pfindbuf = tmp;
 		}
 
-		len = read(fd, pfindbuf + reslen, NAME_INCR);
-		reslen += len;
+		if ((fd = openat(sdir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1 || !(dirp = fdopendir(fd))) {
+			cpfail(errno, 0);
+			if (fd != -1)
+				close(fd);
+			return;
+		}
+		while ((dp = readdir(dirp))) {
+			size_t len = strlen(dp->d_name);
+			if (dp->d_name[0] == '.' && (dp->d_name[1] == '\0' || (dp->d_name[1] == '.' && dp->d_name[2] == '\0')))
+				continue;
+			if (MAX(slen, dlen) + len + 2 > PATH_MAX) {
+				cpfail(ENAMETOOLONG, 0);
+				continue;
+			}
+			src[slen] = dst[dlen] = '/';
+			memcpy(src + slen + 1, dp->d_name, len + 1);
+			memcpy(dst + dlen + 1, dp->d_name, len + 1);
+			copywalk(dirfd(dirp), dp->d_name, src, slen + 1 + len, dst, dlen + 1 + len);
+			cpflush(FALSE);
+		}
+		src[slen] = dst[dlen] = '\0';
+		closedir(dirp);
+		return;
+	}
+
+	if (exists && (S_ISDIR(db.st_mode) || unlink(dst) == -1))
+		err = S_ISDIR(db.st_mode) ? EISDIR : errno;
+	else if (S_ISLNK(sb.st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlinkat(sdir, name, target, PATH_MAX - 1);
+		if (len == -1 || (target[len] = '\0', symlink(target, dst) == -1))
+			err = errno;
+	} else if (mknod(dst, sb.st_mode, sb.st_rdev) == -1)
+		err = errno;
+	if (!err)
+		err = copymeta(-1, dst, &sb);
+	if (!err && cpw.kind == 'm' && unlinkat(sdir, name, 0) == -1)
+		err = errno;
+	++cpw.nfound;
+	if (err)
+		cpfail(err, 1);
+	else
+		++cpw.ndone;
+}
+
+/* Move src to dst by renaming it, or by copying it when it is on another filesystem */
+static void movepath(char *src, size_t slen, char *dst, size_t dlen)
+{
+	struct stat sb;
+	int ret;
+
+#ifdef RENAME_NOREPLACE
+	if ((ret = renameat2(AT_FDCWD, src, AT_FDCWD, dst, cpw.mode == 'n' ? RENAME_NOREPLACE : 0)) == -1
+	&& cpw.mode == 'n' && (errno == EINVAL || errno == ENOSYS)) // Not supported by the filesystem
+#endif
+		ret = (cpw.mode == 'n' && lstat(dst, &sb) == 0) ? (errno = EEXIST, -1) : rename(src, dst);
+
+	if (ret == 0)
+		++cpw.ndone;
+	else if (errno == EXDEV) {
+		copywalk(AT_FDCWD, src, src, slen, dst, dlen);
+		return;
+	} else if (errno != EEXIST || cpw.mode != 'n')
+		cpfail(errno, 0);
+	++cpw.nfound;
+}
+
+/* Parse a chmod mode: octal, or symbolic clauses like u+x,go-w,a=rX */
+static int parsemode(const char *str)
+{
+	mode_t um = umask(0), who;
+	char *end;
+	unsigned long val = strtoul(str, &end, 8);
+
+	umask(um);
+	cpw.nmodeop = 0;
+	if (str[0] >= '0' && str[0] <= '7' && *end == '\0') {
+		if (val > 07777)
+			return FALSE;
+		cpw.modeop[cpw.nmodeop++] = (struct modeop){07777, val, '=', 0};
+		return TRUE;
 	}
 
-	if (len == -1 && seterrnum(__LINE__, errno)) {
-		free(pfindbuf);
-		pfindbuf = NULL;
+	for (const char *p = str; ; ++p) { // One clause per iteration
+		for (who = 0; *p && strchr("ugoa", *p); ++p)
+			who |= (*p == 'u') ? 04700 : (*p == 'g') ? 02070 : (*p == 'o') ? 01007 : 07777;
+		if (who == 0) // As if 'a' was given, without the bits of the umask
+			who = 07777 & ~um;
+		if (!*p || !strchr("+-=", *p))
+			return FALSE;
+
+		while (*p && strchr("+-=", *p)) {
+			struct modeop *op = &cpw.modeop[cpw.nmodeop];
+			if (cpw.nmodeop++ == MODEOP_MAX)
+				return FALSE;
+			*op = (struct modeop){who, 0, *p++, 0};
+			if (*p && strchr("ugo", *p))
+				op->from = *p++;
+			else for (; *p && strchr("rwxXst", *p); ++p) {
+				switch (*p) {
+				case 'r': op->perm |= 0444; break;
+				case 'w': op->perm |= 0222; break;
+				case 'x': op->perm |= 0111; break;
+				case 'X': op->from = 'X'; break;
+				case 's': op->perm |= 06000; break;
+				case 't': op->perm |= 01000; break;
+				}
+			}
+		}
+		if (*p != ',')
+			return *p == '\0';
+	}
+}
+
+/* Parse a chown owner: user, user:group, user: (the login group of user) or :group, by name or id */
+static int parseowner(const char *str)
+{
+	char user[LOGIN_NAME_MAX + 1] = "", *end;
+	const char *group = strchr(str, ':');
+	size_t len = group ? (size_t)(group - str) : strlen(str);
+	struct passwd *pw = NULL;
+	struct group *gr;
+
+	if (len > LOGIN_NAME_MAX)
+		return FALSE;
+	memcpy(user, str, len);
+	cpw.uid = (uid_t)-1;
+	cpw.gid = (gid_t)-1;
+	if (user[0]) {
+		if ((pw = getpwnam(user)))
+			cpw.uid = pw->pw_uid;
+		else if ((cpw.uid = strtoul(user, &end, 10), *end != '\0'))
+			return FALSE;
+	}
+	if (!group || !*++group) {
+		if (group && pw)
+			cpw.gid = pw->pw_gid;
+		return (user[0] && (!group || pw));
+	}
+	if ((gr = getgrnam(group)))
+		cpw.gid = gr->gr_gid;
+	else if ((cpw.gid = strtoul(group, &end, 10), *end != '\0'))
+		return FALSE;
+	return TRUE;
+}
+
+static mode_t applymode(mode_t mode, int isdir)
+{
+	for (int i = 0; i < cpw.nmodeop; ++i) {
+		struct modeop *op = &cpw.modeop[i];
+		mode_t perm = op->perm;
+
+		if (op->from == 'X' && (isdir || (mode & 0111)))
+			perm |= 0111;
+		else if (op->from && op->from != 'X')
+			perm = ((mode >> (op->from == 'u' ? 6 : op->from == 'g' ? 3 : 0)) & 7) * 0111;
+		perm &= op->who;
+		if (op->op == '+')
+			mode |= perm;
+		else if (op->op == '-')
+			mode &= ~perm;
+		else if (isdir && !(perm & 06000)) // Set-id bits of directories are only cleared by name, as chmod does
+			mode = (mode & ~op->who) | perm | (mode & op->who & 06000);
+		else
+			mode = (mode & ~op->who) | perm;
+	}
+	return mode & 07777;
+}
+
+/* Apply the tree operation to name in directory dfd, of d_type type. Returns an errno, and sets *dir to 1
+   for a directory to walk, or 2 for one to walk and finish last. Paths given by the user (top) follow symlinks. */
+static int treeapply(int dfd, const char *name, int type, int top, int *dir)
+{
+	struct stat sb;
+	int walk = (cpw.mode == 'r'), isdir = (type == DT_DIR);
+	mode_t mode;
+
+	*dir = 0;
+	if (type == DT_UNKNOWN || cpw.kind == 'p') {
+		if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+			return errno;
+		isdir = S_ISDIR(sb.st_mode);
+	}
+
+	switch (cpw.kind) {
+	case 'd':
+		if (isdir && walk)
+			*dir = 2; // Removed once empty
+		else if (unlinkat(dfd, name, isdir ? AT_REMOVEDIR : 0) == -1)
+			return errno;
+		return 0;
+	case 'o':
+		if (fchownat(dfd, name, cpw.uid, cpw.gid, top ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+			return errno;
+		*dir = (isdir && walk);
+		return 0;
+	}
+
+	if (S_ISLNK(sb.st_mode) && (!top || fstatat(dfd, name, &sb, 0) == -1)) // chmod cannot change links, and skips them in directories like chmod -R
+		return top ? errno : 0;
+	mode = applymode(sb.st_mode, S_ISDIR(sb.st_mode));
+	if (isdir && walk && (mode & 0500) != 0500) // Cannot be walked after the change
+		*dir = 2;
+	else if (mode != (sb.st_mode & 07777) && fchmodat(dfd, name, mode, 0) == -1)
+		return errno;
+	else
+		*dir = (isdir && walk);
+	return 0;
+}
+
+/* Apply the tree operation to the entries of the directory path in a worker, sending back its subdirectories */
+static void treedir(const char *path)
+{
+	char buf[PATH_MAX + 1];
+	size_t plen = strlen(path);
+	struct dirent *dp;
+	DIR *dirp;
+	int fd, dir, err;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1 || !(dirp = fdopendir(fd))) {
+		cpfail(errno, 0);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	memcpy(buf + 1, path, plen);
+	buf[plen + 1] = '/';
+	while ((dp = readdir(dirp))) {
+		size_t len = strlen(dp->d_name);
+		if (dp->d_name[0] == '.' && (dp->d_name[1] == '\0' || (dp->d_name[1] == '.' && dp->d_name[2] == '\0')))
+			continue;
+
+		++cpw.nfound;
+		if ((err = treeapply(dirfd(dirp), dp->d_name, dp->d_type, FALSE, &dir)) == 0 && dir) {
+			if (plen + len + 2 > PATH_MAX)
+				err = ENAMETOOLONG;
+			else {
+				buf[0] = '0' + dir;
+				memcpy(buf + plen + 2, dp->d_name, len + 1);
+				if (send(cpw.sock, buf, plen + len + 3, 0) == -1)
+					err = errno;
+			}
+		}
+		if (err)
+			cpfail(err, 1);
+		else if (dir != 2)
+			++cpw.ndone;
+		cpflush(FALSE);
+	}
+	closedir(dirp);
+	cpflush(FALSE);
+}
+
+static void treeworker(void)
+{
+	char buf[PATH_MAX + 1];
+
+	while (recv(cpw.sock, buf, sizeof(buf), 0) > 0) {
+		treedir(buf);
+		send(cpw.sock, "", 0, 0); // Done with it
+	}
+	cpflush(TRUE);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Append a copy of str to the list *v of *n strings */
+static int appendpath(char ***v, size_t *n, const char *str)
+{
+	char **tmp = ((*n & (*n - 1)) == 0) ? realloc(*v, MAX(*n * 2, 16) * sizeof(char *)) : *v; // Grown at powers of two
+
+	if (!tmp || !(tmp[*n] = strdup(str))) {
+		if (tmp)
+			*v = tmp;
+		return FALSE;
+	}
+	*v = tmp;
+	++*n;
+	return TRUE;
+}
+
+/* The coordinator of a tree operation: apply it to the paths in the list from p to end, and hand the
+   directories out to the workers until none is left. Then finish the directories that had to wait. */
+static void runtree(char *p, char *end)
+{
+	char buf[PATH_MAX + 1], **queue = NULL, **last = NULL;
+	size_t nqueue = 0, qhead = 0, nlast = 0;
+	unsigned long pending = 0; // Directories given to the workers and not done yet
+	struct pollfd pfd = {cpw.sock, POLLIN, 0};
+	ssize_t len;
+	int dir, err;
+
+	for (; p < end; p += strlen(p) + 1) {
+		if (!*p)
+			continue;
+		++cpw.nfound;
+		if ((err = treeapply(AT_FDCWD, p, DT_UNKNOWN, TRUE, &dir)) == 0 && dir
+		&& (!appendpath(&queue, &nqueue, p) || (dir == 2 && !appendpath(&last, &nlast, p))))
+			err = errno;
+		if (err)
+			cpfail(err, 1);
+		else if (dir != 2)
+			++cpw.ndone;
+	}
+	cpflush(FALSE);
+
+	fcntl(cpw.sock, F_SETFL, O_NONBLOCK);
+	while (qhead < nqueue || pending > 0) {
+		for (; qhead < nqueue; free(queue[qhead++])) {
+			if (send(cpw.sock, queue[qhead], strlen(queue[qhead]) + 1, 0) == -1) {
+				if (errno == EAGAIN)
+					break;
+				cpfail(errno, 0);
+			} else
+				++pending;
+		}
+		if (qhead == nqueue)
+			qhead = nqueue = 0;
+
+		pfd.events = (qhead < nqueue) ? POLLIN | POLLOUT : POLLIN;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			break;
+		while ((len = recv(cpw.sock, buf, sizeof(buf), 0)) >= 0) {
+			if (len == 0)
+				--pending;
+			else if (!appendpath(&queue, &nqueue, buf + 1) || (buf[0] == '2' && !appendpath(&last, &nlast, buf + 1)))
+				cpfail(errno, 0);
+		}
+	}
+
+	fcntl(cpw.sock, F_SETFL, 0);
+	for (int i = 0; i < COPY_JOBS; ++i)
+		send(cpw.sock, "", 0, 0);
+	while (wait(NULL) > 0)
+		;
+	while (nlast > 0) { // Deepest first, as they were found top down
+		struct stat sb;
+		char *path = last[--nlast];
+		if (cpw.kind == 'd')
+			err = (rmdir(path) == -1) ? errno : 0;
+		else
+			err = (lstat(path, &sb) == -1 || fchmodat(AT_FDCWD, path, applymode(sb.st_mode, TRUE), 0) == -1) ? errno : 0;
+		if (err)
+			cpfail(err, 1);
+		else
+			++cpw.ndone;
+		cpflush(FALSE);
+	}
+	cpflush(TRUE);
+	_exit(EXIT_SUCCESS);
+}
+
+/* The walker: start the workers, walk the pairs of source and target directory in list, and wait for the workers */
+static void runcopy(const char *list)
+{
+	char src[PATH_MAX], dst[PATH_MAX], *buf;
+	struct stat sb;
+	int fd, sv[2];
+
+	sigaction(SIGCHLD, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+	sigaction(SIGTERM, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+	sigaction(SIGHUP, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+	setpgid(0, 0); // The workers too, so that canceljob() stops them all
+	fcntl(cpw.out, F_SETFL, O_NONBLOCK); // See cpflush
+	if ((fd = open(list, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &sb) == -1 || !(buf = malloc(sb.st_size + 1))
+	|| !readall(fd, buf, sb.st_size) || socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+		cpfail(errno, 0);
+		cpflush(TRUE);
+		_exit(EXIT_FAILURE);
+	}
+	close(fd);
+	buf[sb.st_size] = '\0';
+
+	for (int i = 0; i < COPY_JOBS; ++i) {
+		if (fork() == 0) {
+			close(sv[0]);
+			cpw.sock = sv[1];
+			if (cpw.kind == 'c' || cpw.kind == 'm')
+				copyworker();
+			treeworker();
+		}
+	}
+	close(sv[1]);
+	cpw.sock = sv[0];
+	if (cpw.kind != 'c' && cpw.kind != 'm')
+		runtree(buf, buf + sb.st_size);
+
+	// A target ending with '/' is the directory to put the source in, otherwise its new path
+	for (char *p = buf, *end = buf + sb.st_size, *to; p < end; p = to + strlen(to) + 1) {
+		size_t slen = strlen(p), dlen;
+		if ((to = p + slen + 1) >= end)
+			break;
+		memcpy(src, p, slen + 1);
+		dlen = strlen(to);
+		if (dlen == 0 || (to[dlen - 1] == '/' ? !makepath(to, xbasename(src), dst) : !memccpy(dst, to, '\0', PATH_MAX))) {
+			cpfail(ENAMETOOLONG, 0);
+			continue;
+		}
+		dlen = strlen(dst);
+		if (dlen > slen && strncmp(dst, src, slen) == 0 && dst[slen] == '/') { // Into itself
+			cpfail(EINVAL, 0);
+			continue;
+		}
+		if (cpw.kind == 'm')
+			movepath(src, slen, dst, dlen);
+		else
+			copywalk(AT_FDCWD, src, src, slen, dst, dlen);
+		cpflush(FALSE);
+	}
+	cpflush(TRUE);
+
+	for (int i = 0; i < COPY_JOBS; ++i)
+		send(cpw.sock, "", 0, 0);
+	while (wait(NULL) > 0)
+		;
+	while (cpw.ndir > 0) { // Deepest first
+		struct cpdir *d = &cpw.dirs[--cpw.ndir];
+		int err = d->meta ? copymeta(-1, d->path, &d->sb) : 0;
+		if (!err && d->src && rmdir(d->src) == -1 && errno != ENOTEMPTY && errno != EEXIST) // Skipped files are left
+			err = errno;
+		if (err)
+			cpfail(err, 0);
+	}
+	cpflush(TRUE);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Copy (kind 'c') or move ('m') the pairs of source and target in an exec buffer of sff-extfunc
+   (buf '1', '2' or '3') in the background. Existing files are overwritten with mode 'f', or skipped with 'n'.
+   Delete ('d'), chmod ('p') or chown ('o') the paths in it instead, recursively with mode 'r'. */
+static int startcopy(int kind, int mode, int buf)
+{
+	char name[] = ".exec-buf1";
+	int pfd[2];
+	pid_t pid;
+
+	if (cpfd != -1 && seterrnum(__LINE__, EBUSY))
 		return FALSE;
+	name[sizeof(name) - 2] = buf;
+	if (!makepath(cfgpath, name, gpbuf) || (pipe(pfd) == -1 && seterrnum(__LINE__, errno)))
+		return FALSE;
+
+	pid = fork();
+	if (pid == 0) {
+		close(pfd[0]);
+		cpw.out = pfd[1];
+		cpw.kind = kind;
+		cpw.mode = mode;
+		runcopy(gpbuf);
 	}
 
-	pfindend = pfindbuf + reslen;
-	*pfindend = '\0';
+	close(pfd[1]);
+	if (pid == -1) {
+		close(pfd[0]);
+		seterrnum(__LINE__, errno);
+		return FALSE;
+	}
+	setpgid(pid, pid); // Also done by the child, whichever runs first
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	cpfd = pfd[0];
+	cppid = pid;
+	cpkind = kind;
+	cpfiles[0] = cpfiles[1] = 0;
+	cpbytes[0] = cpbytes[1] = 0;
+	cperr = 0;
 	return TRUE;
 }
 
+/* Add up the progress of the copy. When it is done, the view is reloaded with the cursor on the
+   first pasted file if it is in the current directory, and the first failure is shown. */
+static int readcopy(void)
+{
+	struct cpmsg m[64];
+	ssize_t len;
+
+	while ((len = read(cpfd, m, sizeof(m))) > 0) {
+		for (size_t i = 0; i < len / sizeof(struct cpmsg); ++i) {
+			cpfiles[m[i].found] += m[i].files;
+			cpbytes[m[i].found] += m[i].bytes;
+			if (m[i].err && !cperr)
+				cperr = m[i].err;
+		}
+	}
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return GO_STATBAR;
+
+	close(cpfd);
+	cpfd = -1;
+	if (cperr)
+		seterrnum(__LINE__, cperr);
+	char *name = strrchr(cppath, '/');
+	if (name && name[1]) {
+		*name++ = '\0';
+		if (strcmp(ptab->hp->path, cppath[0] ? cppath : "/") == 0) {
+			memccpy(ptab->hp->stat->name, name, '\0', NAME_MAX);
+			findname = ptab->hp->stat->name;
+			ptab->hp->stat->cur = cursel;
+			ptab->hp->stat->scrl = curscroll;
+			return GO_RELOAD;
+		}
+	}
+	return refreshview(0);
+}
+
+static int canceljob(int n __attribute__((unused)))
+{
+	if (cpfd == -1)
+		return GO_NONE;
+	if (killpg(cppid, SIGTERM) == -1 && seterrnum(__LINE__, errno))
+		return GO_STATBAR;
+	cperr = ECANCELED; // Shown by readcopy() once the pipe closes
+	return GO_NONE;
+}
+
 static int handlepipedata(int fd, int op)
 {
 	if (op == 0 && read(fd, &op, 1) == -1 && seterrnum(__LINE__, errno))
@@ -1537,14 +3660,36 @@ static int handlepipedata(int fd, int op)
 			return newhistpath(gpbuf, FALSE);
 		break;
 
-	case '?': // load search result
-		if (!readfindresult(fd))
+	case '?': // search results, read in from the main loop as they come
+		cancelfind();
+		if ((findfd = dup(fd)) == -1 && seterrnum(__LINE__, errno))
 			return GO_STATBAR;
+		fcntl(findfd, F_SETFD, FD_CLOEXEC);
+		fcntl(findfd, F_SETFL, O_NONBLOCK);
+		unlink(pipepath); // The producer keeps this FIFO, later extension functions get a new one
+		free(pfindbuf);
+		pfindbuf = pfindend = NULL;
+		findlen = findcap = nfindres = 0;
 		if (!inittab(ptab->hp->path, TABS_MAX))
 			return GO_STATBAR;
 		switchtab(TABS_MAX);
 		return GO_RELOAD;
 
+	case '=': // job in the background, followed by the mode, the exec buffer and the path to select or chmod/chown argument
+		if ((read(fd, gpbuf, PATH_MAX + 3) < 4 || !gpbuf[0] || !strchr("cmdpo", gpbuf[0])
+		|| !gpbuf[1] || !strchr((gpbuf[0] == 'c' || gpbuf[0] == 'm') ? "fn" : "rn", gpbuf[1])
+		|| !gpbuf[2] || !strchr("123", gpbuf[2])
+		|| (gpbuf[0] == 'p' && !parsemode(gpbuf + 3)) || (gpbuf[0] == 'o' && !parseowner(gpbuf + 3)))
+		&& seterrnum(__LINE__, EINVAL))
+			return GO_STATBAR;
+		if (cpfd != -1 && seterrnum(__LINE__, EBUSY)) // cppath is the running job's, the selection is kept
+			return GO_STATBAR;
+		memccpy(cppath, (gpbuf[0] == 'c' || gpbuf[0] == 'm') ? gpbuf + 3 : "", '\0', PATH_MAX);
+		if (!startcopy(gpbuf[0], gpbuf[1], gpbuf[2]))
+			return GO_STATBAR;
+		clearselection(0);
+		return GO_REDRAW;
+
 	case '#': // set preview
 		if (read(fd, &op, 1) == -1 && seterrnum(__LINE__, errno))
 			return GO_STATBAR;
@@ -1557,10 +3702,24 @@ static int handlepipedata(int fd, int op)
 	return GO_REDRAW;
 }
 
+static int makecfgdir(void)
+{
+	if (access(cfgpath, F_OK) == 0)
+		return TRUE;
+
+	memccpy(gpbuf, cfgpath, '\0', PATH_MAX);
+	xdirname(gpbuf);
+	if (mkdir(gpbuf, 0700) == -1 && errno != EEXIST && seterrnum(__LINE__, errno))
+		return FALSE;
+	if (mkdir(cfgpath, 0700) == -1 && seterrnum(__LINE__, errno))
+		return FALSE;
+	return TRUE;
+}
+
 static int callextfunc(int c)
 {
 	pid_t pid, gpid = 0;
-	int fd, len, ctl = GO_STATBAR;
+	int fd, len, ctl = GO_STATBAR, usehlp;
 	struct sigaction oldsigtstp, oldsigwinch;
 	char *args[5] = {sudoer, extfunc, pipepath, (char [2]){c, '\0'}, NULL};
 	char **argv = (gcfg.runmode == 1) ? &args[0] : &args[1];
@@ -1568,19 +3727,18 @@ static int callextfunc(int c)
 	if ((!cfgpath || !extfunc || !pipepath) && seterrnum(__LINE__, ENOENT))
 		return GO_STATBAR;
 
-	if (access(cfgpath, F_OK) == -1) {
-		memccpy(gpbuf, cfgpath, '\0', PATH_MAX);
-		xdirname(gpbuf);
-		if (mkdir(gpbuf, 0700) == -1 && errno != EEXIST && seterrnum(__LINE__, errno))
-			return GO_STATBAR;
-		if (mkdir(cfgpath, 0700) == -1 && seterrnum(__LINE__, errno))
-			return GO_STATBAR;
-	}
+	// In sudo mode the helper runs it as root, so sudo is not run for every function
+	usehlp = (gcfg.runmode == 1 && starthelper());
+	if (hlpcwd && !usehlp && seterrnum(__LINE__, EACCES)) // The working directory is not the one shown
+		return GO_STATBAR;
+
+	if (!makecfgdir())
+		return GO_STATBAR;
 	if (mkfifo(pipepath, 0600) == -1 && errno != EEXIST && seterrnum(__LINE__, errno))
 		return GO_STATBAR;
 
 	endwin();
-	pid = fork();
+	pid = usehlp ? hlpspawn(ptab->hp->path, &args[1]) : fork();
 	if (pid > 0) {
 		sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsigtstp);
 		sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsigwinch);
@@ -1605,7 +3763,10 @@ static int callextfunc(int c)
 			}
 		} else if (errno != EINTR)
 			seterrnum(__LINE__, errno);
-		waitpid(pid, NULL, 0);
+		if (usehlp)
+			hlprecv(gpbuf, 0); // Sent when the function exits
+		else
+			waitpid(pid, NULL, 0);
 		sigaction(SIGTSTP, &oldsigtstp, NULL);
 		sigaction(SIGWINCH, &oldsigwinch, NULL);
 
@@ -1613,6 +3774,8 @@ static int callextfunc(int c)
 		sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
 		sigaction(SIGINT, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
 		sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+		if (cpfd != -1) // The script refuses to start another job
+			setenv("SFF_JOB", (char [2]){cpkind, '\0'}, 1);
 		execvp(*argv, argv);
 		_exit(EXIT_SUCCESS);
 
@@ -1622,13 +3785,42 @@ static int callextfunc(int c)
 	return ctl;
 }
 
-#ifdef __APPLE__
-#define STVNSEC(X)  X##timespec.tv_nsec
-#else
-#define STVNSEC(X)  X##tim.tv_nsec
+#ifndef FNM_CASEFOLD
+#define FNM_CASEFOLD   0
 #endif
 
-static void fillentry(int fd, Entry *ent, struct stat sb)
+/* Returns the LS_COLORS style of a file by its name suffix, or its type style if no rule matches */
+static unsigned short getlsstyle(const Entry *ent)
+{
+	char buf[NAME_MAX + 1], *p = buf;
+	const char *name = strrchr(ent->name, '/'); // search results are paths
+	size_t len;
+
+	name = name ? name + 1 : ent->name;
+	len = ent->name + ent->nlen - 1 - name;
+	for (unsigned int i = 0; i < nlssfx; ++i) {
+		size_t n = strlen(plssfx[i].sfx);
+		if (n <= len && strcasecmp(name + len - n, plssfx[i].sfx) == 0)
+			return plssfx[i].style;
+	}
+
+	if (lsextcap == 0 || !(name = strchr(name, '.')))
+		return ent->type;
+	for (len = 0; name[len] && len < NAME_MAX; ++len)
+		buf[len] = (char)tolower((unsigned char)name[len]);
+	buf[len] = '\0';
+
+	// Try the longest suffix first, so that .tar.gz wins over .gz
+	for (; p; p = strchr(p + 1, '.')) {
+		unsigned int h = hashstr(p), mask = lsextcap - 1;
+		for (unsigned int i = h & mask; plsext[i].sfx; i = (i + 1) & mask)
+			if (plsext[i].hash == h && strcmp(plsext[i].sfx, p) == 0)
+				return plsext[i].style;
+	}
+	return ent->type;
+}
+
+static void fillentry(Entry *ent, struct stat sb)
 {
 	switch (ptab->cfg.timetype) {
 	case 0: ent->sec = sb.st_atime;
@@ -1660,9 +3852,7 @@ static void fillentry(int fd, Entry *ent, struct stat sb)
 		ent->flag |= E_DIR_DIRLNK;
 		break;
 	case S_IFLNK: ent->type = F_LNK;
-		fstatat(fd, ent->name, &sb, 0);
-		if (S_ISDIR(sb.st_mode))
-			ent->flag |= E_DIR_DIRLNK;
+		ent->flag |= E_LNK_PEND; // followed by resolvelink() when needed
 		break;
 
 	case S_IFCHR: ent->type = F_CHR;
@@ -1676,17 +3866,62 @@ static void fillentry(int fd, Entry *ent, struct stat sb)
 	default: ent->type = F_UNKN;
 	}
 
-	if (gcfg.marknew && (curtime - sb.st_ctime < 300))
+	ent->color = ent->type;
+	if ((lsextcap || nlssfx) && (ent->type == F_REG || ent->type == F_HLNK))
+		ent->color = getlsstyle(ent);
+
+	if (gcfg.marknew && (curtime - sb.st_ctime < 300)) {
 		ent->flag |= E_NEW;
+		if (newmarkend == 0 || sb.st_ctime + 300 < newmarkend)
+			newmarkend = sb.st_ctime + 300;
+	}
 }
 
-static void loaddirentry(DIR *dirp, int fd)
+/* Add an entry for name, stored at *off of pnamebuf. Returns NULL if out of memory. */
+static Entry *addentry(const char *name, size_t *off)
 {
-	char *name, *tmp;
-	size_t off = 0;
+	char *tmp;
+	Entry *ent, *tmpent;
+
+	if (ndents == tdents) {
+		tmpent = realloc(pdents, (tdents += ENTRY_INCR) * sizeof(Entry));
+		if (!tmpent && seterrnum(__LINE__, errno)) {
+			tdents -= ENTRY_INCR;
+			return NULL;
+		}
+		pdents = tmpent;
+	}
+
+	if (namebuflen - *off <= NAME_MAX) {
+		tmp = realloc(pnamebuf, namebuflen += NAME_INCR);
+		if (!tmp && seterrnum(__LINE__, errno)) {
+			namebuflen -= NAME_INCR;
+			return NULL;
+		}
+
+		// Reset entry names if realloc() causes memory move
+		if (pnamebuf != tmp) {
+			pnamebuf = tmp;
+			for (int i = 0; i < ndents; tmp += pdents[i].nlen, ++i)
+				pdents[i].name = tmp;
+		}
+	}
+
+	ent = pdents + ndents;
+	ent->name = pnamebuf + *off;
+	tmp = memccpy(ent->name, name, '\0', NAME_MAX + 1);
+	ent->nlen = tmp - ent->name; // include terminational '\0'
+	*off += ent->nlen;
+	return ent;
+}
+
+static void loaddirentry(DIR *dirp, int fd)
+{
+	char *name;
+	size_t off = 0;
 	struct dirent *dp;
 	struct stat sb;
-	Entry *ent, *tmpent;
+	Entry *ent;
 
 	while ((dp = readdir(dirp))) {
 		name = dp->d_name;
@@ -1697,49 +3932,60 @@ static void loaddirentry(DIR *dirp, int fd)
 			continue;
 		if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
 			continue;
+		if (!(ent = addentry(name, &off)))
+			return;
 
-		if (ndents == tdents) {
-			tmpent = realloc(pdents, (tdents += ENTRY_INCR) * sizeof(Entry));
-			if (!tmpent && seterrnum(__LINE__, errno)) {
-				tdents -= ENTRY_INCR;
-				return;
-			}
-			pdents = tmpent;
-		}
+		fillentry(ent, sb);
+		++ndents;
+	}
+}
 
-		if (namebuflen - off <= NAME_MAX) {
-			tmp = realloc(pnamebuf, namebuflen += NAME_INCR);
-			if (!tmp && seterrnum(__LINE__, errno)) {
-				namebuflen -= NAME_INCR;
-				return;
+/* Load a directory the user cannot read, as listed by the helper */
+static void loadhlpentry(const char *path)
+{
+	static char buf[HLP_BUF];
+	struct hlpent he;
+	size_t off = 0;
+	ssize_t len;
+	int full = FALSE;
+	Entry *ent;
+
+	if (!hlpsend('L', path, strlen(path) + 1, NULL, 0) && seterrnum(__LINE__, errno))
+		return;
+
+	while ((len = hlprecv(buf, HLP_BUF)) > 0) {
+		for (char *p = buf; p < buf + len; p += sizeof(he) + he.nlen) {
+			memcpy(&he, p, sizeof(he));
+			if (full || (p[sizeof(he)] == '.' && !ptab->cfg.showhidden))
+				continue;
+			if (!(ent = addentry(p + sizeof(he), &off))) {
+				full = TRUE; // Read the rest of the listing all the same
+				continue;
 			}
 
-			// Reset entry names if realloc() causes memory move
-			if (pnamebuf != tmp) {
-				pnamebuf = tmp;
-				for (int i = 0; i < ndents; tmp += pdents[i].nlen, ++i)
-					pdents[i].name = tmp;
+			fillentry(ent, he.sb);
+			if (ent->flag & E_LNK_PEND) { // Already followed by the helper
+				ent->flag &= ~E_LNK_PEND;
+				if (he.tmode == 0)
+					ent->type = ent->color = F_ORPH;
+				else if (S_ISDIR(he.tmode))
+					ent->flag |= E_DIR_DIRLNK;
 			}
+			++ndents;
 		}
-
-		ent = pdents + ndents;
-		ent->name = pnamebuf + off;
-		tmp = memccpy(ent->name, name, '\0', NAME_MAX + 1);
-		ent->nlen = tmp - ent->name; // include terminational '\0'
-		off += ent->nlen;
-
-		fillentry(fd, ent, sb);
-		++ndents;
 	}
+	if (len == -1)
+		seterrnum(__LINE__, errno);
 }
 
-static void loadsrchentry(int fd)
+/* Load search results from the one at from, up to pfindend */
+static void loadsrchentry(int fd, char *from)
 {
 	struct stat sb;
 	Entry *ent, *tmpent;
 
-	for (char *name = pfindbuf, *end; name < pfindend && (end = memchr(name, '\0', PATH_MAX)); name = end + 1) {
-		if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+	for (char *name = from, *end; name < pfindend && (end = memchr(name, '\0', PATH_MAX)); name = end + 1) {
+		if (entstat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
 			continue;
 
 		if (ndents == tdents) {
@@ -1755,7 +4001,7 @@ static void loadsrchentry(int fd)
 		ent->name = name;
 		ent->nlen = end - name + 1;
 
-		fillentry(fd, ent, sb);
+		fillentry(ent, sb);
 		++ndents;
 	}
 }
@@ -1763,56 +4009,82 @@ static void loadsrchentry(int fd)
 static void loadentries(const char *path)
 {
 	ndents = 0;
+	dispcols = -1; // Names are reloaded, drop cached display names
 	curtime = time(NULL);
+	newmarkend = 0;
+	settimer(T_NEWMARK, -1);
 	DIR *dirp = opendir(path);
-	if (!dirp && seterrnum(__LINE__, errno))
+	if (dirp) {
+		int fd = dirfd(dirp);
+		if (ptab->hp->stat->flag != S_ROOT)
+			loaddirentry(dirp, fd); // Load dir entry
+		else if (pfindbuf)
+			loadsrchentry(fd, pfindbuf); // Load search result
+		closedir(dirp);
+	} else if (usehelper()) {
+		if (ptab->hp->stat->flag != S_ROOT)
+			loadhlpentry(path);
+		else if (pfindbuf)
+			loadsrchentry(AT_FDCWD, pfindbuf);
+	} else {
+		seterrnum(__LINE__, errno);
 		return;
-
-	int fd = dirfd(dirp);
-	if (ptab->hp->stat->flag != S_ROOT)
-		loaddirentry(dirp, fd); // Load dir entry
-	else if (pfindbuf)
-		loadsrchentry(fd); // Load search result
-
-	closedir(dirp);
+	}
 	ptab->nde = ndents;
+	++loadgen;
+	if (newmarkend)
+		settimer(T_NEWMARK, (newmarkend - curtime) * 1000LL);
+}
+
+/* Mark a reloaded entry as selected, and keep the selected size in step with it */
+static void syncselslot(struct selslot *slot, Entry *ent)
+{
+	if (!slot)
+		return;
+	ent->flag |= E_SEL;
+	if (slot->cat != 1 && slot->size != ent->size) {
+		ptab->selsize += ent->size - slot->size;
+		slot->size = ent->size;
+	}
 }
 
-static void setcurrentstat(Histpath *hp, struct selstat *ss)
+static void setcurrentstat(Histpath *hp)
 {
 	Histstat *hs = hp->stat;
+	struct selstat *ss;
 
 	// Find current entry, and set cursel
 	if (findname) {
 		if (hs->cur >= ndents || strcmp(findname, pdents[hs->cur].name) != 0) {
-			for (int i = 0; i < ndents; ++i) {
-				if (strcmp(findname, pdents[i].name) == 0) {
-					hs->cur = i;
-					hs->scrl = MAX(i - (onscr * 3 >> 2), MIN(i - (onscr >> 2), hs->scrl));
-					break;
-				}
+			int i = findentry(findname);
+			if (i >= 0 && i < ndents) {
+				hs->cur = i;
+				hs->scrl = MAX(i - (onscr * 3 >> 2), MIN(i - (onscr >> 2), hs->scrl));
 			}
 		}
 		findname = NULL;
 	}
-	cursel = hs->cur;
-	curscroll = hs->scrl;
+	cursel = MIN(hs->cur, MAX(ndents - 1, 0)); // The directory may have changed since, as in a restored session
+	curscroll = MIN(hs->scrl, cursel);
 
-	// Find corresponding selstat, and set selection status
+	// Find corresponding selstat, and mark selected entries
 	ptab->cfg.havesel = 0;
 	markent = -1;
-	if (!ss)
+	if (!(ss = findselstat(ptab, hp->path)))
 		return;
-	while (ss->next)
-		ss = ss->next;
-
-	do {
-		if (strcmp(ss->path, hp->path) == 0) {
-			ptab->cfg.havesel = 1;
-			ptab->ss = ss;
-			break;
+	ptab->cfg.havesel = 1;
+	ptab->ss = ss;
+
+	if (ss->nname < (unsigned int)ptab->nde) {
+		for (char *pos = ss->nbuf; pos < ss->endp; pos += strlen(pos + 1) + 2) {
+			int i = *pos ? findentry(pos + 1) : -1;
+			if (i >= 0)
+				syncselslot(findselslot(ss, pos + 1, hashstr(pos + 1)), &pdents[i]);
 		}
-	} while ((ss = ss->prev));
+	} else {
+		for (int i = 0; i < ptab->nde; ++i)
+			syncselslot(findselslot(ss, pdents[i].name, hashstr(pdents[i].name)), &pdents[i]);
+	}
 }
 
 static int xmbstowcs(wchar_t *dst, const char *str, int maxcols)
@@ -1875,16 +4147,120 @@ static wchar_t *fitpathcols(const char *path, int maxcols)
 			*wbp = *tbp;
 		}
 
-		int i, len;
-		for (i = len = wbp - wbuf; wcswidth(wbuf, i) > maxcols; --i) // Reduce wide chars to fit room
-			;
-		if (i < len)
+		int i, len, width;
+		for (i = len = wbp - wbuf, width = wcswidth(wbuf, len); width > maxcols && i > 0; --i) // Reduce wide chars to fit room
+			width -= wcwidth(wbuf[i - 1]);
+		if (i < len && i > 0)
 			wbuf[i - 1] = L'~';
 		wbuf[i] = L'\0';
 	}
 	return wbuf;
 }
 
+/* Returns the display cache record of an entry. Records are kept until the names
+   are reloaded or the name column width changes. */
+static struct dispname *getdispname(const Entry *ent)
+{
+	unsigned int mask, i;
+
+	if (ncols != dispcols) {
+		if (pdispidx)
+			memset(pdispidx, 0, dispidxcap * sizeof(struct dispname));
+		ndispidx = 0;
+		dispbuflen = lnkbuflen = 0;
+		dispcols = ncols;
+	}
+
+	if ((ndispidx + 1) * 2 > dispidxcap) {
+		unsigned int cap = MAX(256, dispidxcap * 2);
+		struct dispname *tmp = calloc(cap, sizeof(struct dispname));
+		if (!tmp)
+			return NULL;
+		for (i = 0; i < dispidxcap; ++i) {
+			if (!pdispidx[i].name)
+				continue;
+			unsigned int j = (unsigned int)((size_t)pdispidx[i].name >> 3) & (cap - 1);
+			while (tmp[j].name)
+				j = (j + 1) & (cap - 1);
+			tmp[j] = pdispidx[i];
+		}
+		free(pdispidx);
+		pdispidx = tmp;
+		dispidxcap = cap;
+	}
+
+	mask = dispidxcap - 1;
+	for (i = (unsigned int)((size_t)ent->name >> 3) & mask; pdispidx[i].name; i = (i + 1) & mask)
+		if (pdispidx[i].name == ent->name)
+			return &pdispidx[i];
+
+	pdispidx[i].name = ent->name;
+	pdispidx[i].off = pdispidx[i].loff = (size_t)-1;
+	pdispidx[i].tstr[0] = '\0';
+	++ndispidx;
+	return &pdispidx[i];
+}
+
+/* Fit an entry name into the name column, decoding it only the first time it is drawn */
+static const wchar_t *fitentcols(const Entry *ent)
+{
+	struct dispname *dn = getdispname(ent);
+	const wchar_t *wstr;
+	size_t len;
+
+	if (dn && dn->off != (size_t)-1)
+		return pdispbuf + dn->off;
+
+	wstr = (ptab->hp->stat->flag != S_ROOT) ? fitnamecols(ent->name, ncols) : fitpathcols(ent->name, ncols);
+	len = wcslen(wstr) + 1;
+	if (!dn)
+		return wstr;
+	if (dispbuflen + len > dispbufcap) {
+		size_t cap = MAX(dispbufcap * 2, dispbuflen + len + 4096);
+		wchar_t *tmp = realloc(pdispbuf, cap * sizeof(wchar_t));
+		if (!tmp)
+			return wstr;
+		pdispbuf = tmp;
+		dispbufcap = cap;
+	}
+	wmemcpy(pdispbuf + dispbuflen, wstr, len);
+	dn->off = dispbuflen;
+	dispbuflen += len;
+	return pdispbuf + dn->off;
+}
+
+
+/* Returns the target of a symlink entry, reading it only the first time */
+static const char *getlinktarget(const Entry *ent)
+{
+	struct dispname *dn = getdispname(ent);
+	char *p = &gpbuf[PATH_MAX * (sizeof(wchar_t) - 1) - 1]; // fitnamecols use gpbuf, so use last portion here
+	ssize_t len;
+
+	if (dn && dn->loff != (size_t)-1)
+		return plnkbuf[dn->loff] ? plnkbuf + dn->loff : NULL;
+
+	if (hlpcwd)
+		len = hlppathop('K', ent->name, p, PATH_MAX - 1);
+	else
+		len = readlink(ent->name, p, PATH_MAX - 1);
+	p[MAX(len, 0)] = '\0';
+	if (!dn)
+		return len > 0 ? p : NULL;
+	if (lnkbuflen + len + 1 > lnkbufcap) {
+		size_t cap = MAX(lnkbufcap * 2, lnkbuflen + PATH_MAX);
+		char *tmp = realloc(plnkbuf, cap);
+		if (!tmp)
+			return len > 0 ? p : NULL;
+		plnkbuf = tmp;
+		lnkbufcap = cap;
+	}
+	memcpy(plnkbuf + lnkbuflen, p, MAX(len, 0) + 1); // an empty target records a failed read
+	dn->loff = lnkbuflen;
+	lnkbuflen += MAX(len, 0) + 1;
+	return len > 0 ? plnkbuf + dn->loff : NULL;
+}
+
 static char *filetypechar(int type)
 {
 	switch (type) {
@@ -1892,89 +4268,266 @@ static char *filetypechar(int type)
 	case F_CHR: return "<c>";
 	case F_BLK: return "<b>";
 	case F_IFO: return "<p>";
-	case F_LNK: return "<l>";
+	case F_LNK:
+	case F_ORPH: return "<l>";
 	case F_SOCK: return "<s>";
 	case F_UNKN: return "<?>";
 	}
 	return "<->";
 }
 
-static void printenttime(const time_t *timep, int useabbr)
+/* Returns the UTC offset of local time for the UTC day of t, or LONG_MIN if it changes
+   within that day. Offsets are cached per day, so only new days cost localtime_r calls. */
+static long getutcoffset(time_t t)
+{
+	static struct { long long day; long off; } cache[64];
+	static int init = FALSE;
+	long long day = (t >= 0 ? t : t - 86399) / 86400;
+	struct tm tm1, tm2;
+
+	if (!init) {
+		for (size_t i = 0; i < LENGTH(cache); ++i)
+			cache[i].day = LLONG_MIN;
+		init = TRUE;
+	}
+	if (cache[day & 63].day == day)
+		return cache[day & 63].off;
+
+	time_t t1 = (time_t)(day * 86400), t2 = t1 + 86399;
+	localtime_r(&t1, &tm1);
+	localtime_r(&t2, &tm2);
+	cache[day & 63].day = day;
+	cache[day & 63].off = (tm1.tm_gmtoff == tm2.tm_gmtoff) ? tm1.tm_gmtoff : LONG_MIN;
+	return cache[day & 63].off;
+}
+
+/* Break t down to local year, month (0-11), day, hour and minute */
+static void getlocaltime(time_t t, int *year, int *mon, int *mday, int *hour, int *min)
 {
-	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-				"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-	struct tm t, now;
+	long off = getutcoffset(t);
+
+	if (off == LONG_MIN) { // DST transition on this day
+		struct tm tm;
+		localtime_r(&t, &tm);
+		*year = tm.tm_year + 1900;
+		*mon = tm.tm_mon;
+		*mday = tm.tm_mday;
+		*hour = tm.tm_hour;
+		*min = tm.tm_min;
+		return;
+	}
+
+	// Days to civil date, see http://howardhinnant.github.io/date_algorithms.html
+	long long lt = (long long)t + off;
+	long long z = (lt >= 0 ? lt : lt - 86399) / 86400, secs = lt - z * 86400;
+	z += 719468;
+	long long era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned int doe = (unsigned int)(z - era * 146097);
+	unsigned int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned int mp = (5 * doy + 2) / 153;
+
+	*mday = doy - (153 * mp + 2) / 5 + 1;
+	*mon = mp < 10 ? mp + 2 : mp - 10;
+	*year = (int)(yoe + era * 400 + (*mon <= 1));
+	*hour = (int)(secs / 3600);
+	*min = (int)(secs / 60 % 60);
+}
 
-	localtime_r(timep, &t);
+/* Format t into buf (at least 24 bytes) without stdio */
+static char *fmttime(time_t t, int useabbr, char *buf)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	static time_t lastnow = -1;
+	static int nowyear;
+	int year, mon, mday, hour, min, tmp;
+	char *p = buf;
+
+	getlocaltime(t, &year, &mon, &mday, &hour, &min);
+	*p++ = ' ';
 	if (useabbr) {
-		localtime_r(&curtime, &now);
-		if (t.tm_year == now.tm_year)
-			printw(" %s %2d %02d:%02d ", months[t.tm_mon], t.tm_mday, t.tm_hour, t.tm_min);
-		else
-			printw(" %s %2d  %s ", months[t.tm_mon], t.tm_mday, xitoa(t.tm_year + 1900));
-	} else
-		printw(" %s-%02d-%02d %02d:%02d ", xitoa(t.tm_year + 1900), t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min);
+		if (curtime != lastnow) {
+			getlocaltime(curtime, &nowyear, &tmp, &tmp, &tmp, &tmp);
+			lastnow = curtime;
+		}
+		memcpy(p, &months[mon * 3], 3);
+		p[3] = ' ';
+		p[4] = mday < 10 ? ' ' : '0' + mday / 10;
+		p[5] = '0' + mday % 10;
+		p[6] = ' ';
+		p += 7;
+		if (year == nowyear) {
+			*p++ = '0' + hour / 10;
+			*p++ = '0' + hour % 10;
+			*p++ = ':';
+			*p++ = '0' + min / 10;
+			*p++ = '0' + min % 10;
+		} else {
+			*p++ = ' ';
+			p = (char *)memccpy(p, xitoa(MAX(year, 0)), '\0', 12) - 1;
+		}
+	} else {
+		p = (char *)memccpy(p, xitoa(MAX(year, 0)), '\0', 12) - 1;
+		p[0] = '-';
+		p[1] = '0' + (mon + 1) / 10;
+		p[2] = '0' + (mon + 1) % 10;
+		p[3] = '-';
+		p[4] = '0' + mday / 10;
+		p[5] = '0' + mday % 10;
+		p[6] = ' ';
+		p[7] = '0' + hour / 10;
+		p[8] = '0' + hour % 10;
+		p[9] = ':';
+		p[10] = '0' + min / 10;
+		p[11] = '0' + min % 10;
+		p += 12;
+	}
+	p[0] = ' ';
+	p[1] = '\0';
+	return buf;
+}
+
+/* Timestamp column of an entry, rendered once per entry */
+static const char *getenttime(const Entry *ent)
+{
+	static char tbuf[24];
+	struct dispname *dn = getdispname(ent);
+
+	if (!dn)
+		return fmttime(ent->sec, gcfg.abbrdate, tbuf);
+	if (!dn->tstr[0] || dn->tsec != ent->sec) {
+		fmttime(ent->sec, gcfg.abbrdate, dn->tstr);
+		dn->tsec = ent->sec;
+	}
+	return dn->tstr;
+}
+
+/* Add s truncated to prec bytes, padded with spaces to width */
+static void addfield(const char *s, int prec, int width, int left)
+{
+	int len = strnlen(s, prec);
+
+	if (left)
+		addnstr(s, len);
+	for (; len < width; ++len)
+		addch(' ');
+	if (!left)
+		addnstr(s, prec);
 }
 
-static void printent(const Entry *ent, int sel, int mark)
+static void drawname(const Entry *ent, int sel, int mark)
 {
 	int x, y;
-	int attr1 = sel ? 0 : COLOR_PAIR(C_DETAIL); // for details
 	int attr2 = A_BOLD | (mark || (sel && ptab->cfg.mansel) ? COLOR_PAIR(C_STATBAR) | A_REVERSE // for marks
 				: (gcfg.marknew && (ent->flag & E_NEW) ? COLOR_PAIR(C_NEWFILE) | A_REVERSE : 0));
-	int attr3 = COLOR_PAIR(ent->type) // for filename
+	int attr3 = (pstyle ? pstyle[ent->color] : COLOR_PAIR(ent->type)) // for filename
 				| (ent->flag & E_DIR_DIRLNK ? A_BOLD : 0)
 				| ((ent->flag & E_SEL) || (sel && !ptab->cfg.mansel) ? A_REVERSE : 0)
 				| (sel && ptab->cfg.mansel ? A_UNDERLINE : 0);
 
-	attrset(attr1);
-	for (char *p = ptab->cfg.cols; *p; ++p) {
-		switch (*p) {
-		case 'n': addch((sel ? '>' : ' ') | attr2);
-			getyx(stdscr, y, x);
-			attrset(attr3);
-			if (ptab->hp->stat->flag != S_ROOT)
-				addwstr(fitnamecols(ent->name, ncols));
-			else
-				addwstr(fitpathcols(ent->name, ncols));
-			move(y, x + ncols);
-			attrset(attr1);
-			break;
-		case 's': printw("%7s ", (ent->flag & E_REG_FILE) ? tohumansize(ent->size) : filetypechar(ent->type));
-			break;
-		case 't': printenttime(&ent->sec, gcfg.abbrdate);
-			break;
-		case 'p': if (gcfg.symbperm)
-				printw(" %c%s ", filetypechar(ent->type)[1], strperms(ent->mode));
-			else
-				printw(" %c%c%c ", '0' + ((ent->mode >> 6) & 7), '0' + ((ent->mode >> 3) & 7), '0' + (ent->mode & 7));
-			break;
-		case 'o': printw("%7.6s:%-7.6s", getpwname(ent->uid), getgrname(ent->gid));
-		}
+	addch((sel ? '>' : ' ') | attr2);
+	getyx(stdscr, y, x);
+	attrset(attr3);
+	addwstr(fitentcols(ent));
+	move(y, x + ncols);
+	attrset(sel ? 0 : COLOR_PAIR(C_DETAIL));
+}
+
+static void drawsize(const Entry *ent, int sel __attribute__((unused)), int mark __attribute__((unused)))
+{
+	addfield((ent->flag & E_REG_FILE) ? tohumansize(ent->size) : filetypechar(ent->type), 7, 7, FALSE);
+	addch(' ');
+}
+
+static void drawtime(const Entry *ent, int sel __attribute__((unused)), int mark __attribute__((unused)))
+{
+	addstr(getenttime(ent));
+}
+
+static void drawperms(const Entry *ent, int sel __attribute__((unused)), int mark __attribute__((unused)))
+{
+	char buf[16] = {' '}, *p = buf + 1;
+
+	if (gcfg.symbperm) {
+		*p++ = filetypechar(ent->type)[1];
+		p = (char *)memccpy(p, strperms(ent->mode), '\0', 10) - 1;
+	} else {
+		*p++ = '0' + ((ent->mode >> 6) & 7);
+		*p++ = '0' + ((ent->mode >> 3) & 7);
+		*p++ = '0' + (ent->mode & 7);
 	}
+	p[0] = ' ';
+	p[1] = '\0';
+	addstr(buf);
+}
+
+static void drawowner(const Entry *ent, int sel __attribute__((unused)), int mark __attribute__((unused)))
+{
+	addfield(getpwname(ent->uid), 6, 7, FALSE);
+	addch(':');
+	addfield(getgrname(ent->gid), 6, 7, TRUE);
+}
+
+/* Field writers for the enabled columns, in display order. Compiled by redraw. */
+static void (*rplan[8])(const Entry *ent, int sel, int mark);
+static int nrplan = 0;
+
+static void printent(Entry *ent, int sel, int mark)
+{
+	resolvelink(ent);
+	attrset(sel ? 0 : COLOR_PAIR(C_DETAIL)); // for details
+	for (int i = 0; i < nrplan; ++i)
+		rplan[i](ent, sel, mark);
+}
+
+static void drawscrollbar(int clear)
+{
+	int sp = MAX(1, ndents), n;
+
+	n = (sp <= onscr) ? onscr
+		: ((onscr * onscr << 1) / sp + 1) >> 1; // indicator height, round a/b by (a*2/b+1)/2
+	n = MAX(1, n);
+	sp = (curscroll == 0 || sp <= onscr) ? 1
+		: 1 + (((curscroll * (onscr - n) << 1) / (sp - onscr) + 1) >> 1); // starting row to drawing
+	attrset(A_NORMAL); // Same as erased cells, so unchanged rows cost no output
+	for (int i = 2; clear && i < xlines - 2; ++i)
+		mvaddch(i, xcols - 1, ' ');
+	attrset(COLOR_PAIR(C_DETAIL));
+	mvaddch(1, xcols - 1, '=');
+	while (--n >= 0)
+		mvaddch(++sp, xcols - 1, ' ' | A_REVERSE);
+	mvaddch(xlines - 2, xcols - 1, '=');
 }
 
 static void redraw(const char *path)
 {
+	static const char *ftlabels[FM_NUM] = {"Filter: ", " Fuzzy: ", " Regex: ", "  Glob: "};
 	static int homelen = 0;
 	int dcols = 0, sp = 0, n = 0;
 
+	nrplan = 0;
 	for (char *p = ptab->cfg.cols; *p; ++p) {
 		switch (*p) {
-		case 'n': if (++n == 1)
+		case 'n': if (++n == 1) {
 				sp = dcols + 1;
-			else
+				rplan[nrplan++] = drawname;
+			} else
 				*p = '@';
 			break;
 		case 's': dcols += 8;
+			rplan[nrplan++] = drawsize;
 			break;
 		case 't': dcols += gcfg.abbrdate ? 14 : 18;
+			rplan[nrplan++] = drawtime;
 			break;
 		case 'p': dcols += gcfg.symbperm ? 12 : 5;
+			rplan[nrplan++] = drawperms;
 			break;
 		case 'o': dcols += 15;
+			rplan[nrplan++] = drawowner;
 		}
 	}
+	namecolx = sp;
 	getmaxyx(stdscr, xlines, xcols);
 	onscr = xlines - 4;
 	ncols = xcols - dcols - 2;
@@ -2017,11 +4570,6 @@ static void redraw(const char *path)
 	}
 	n = MIN(onscr + curscroll, ndents);
 	for (int i = curscroll, j = 2; i < n; ++i, ++j) {
-		if (ptab->cfg.havesel && !(pdents[i].flag & E_SEL_SCANED)) {
-			if (findinbuf(ptab->ss->nbuf, ptab->ss->endp - ptab->ss->nbuf, pdents[i].name, pdents[i].nlen))
-				pdents[i].flag |= E_SEL;
-			pdents[i].flag |= E_SEL_SCANED;
-		}
 		move(j, 0);
 		printent(&pdents[i], i == cursel, i == markent);
 	}
@@ -2033,7 +4581,7 @@ static void redraw(const char *path)
 	// Print filter
 	if (ptab->ftlen != 0) {
 		attrset(COLOR_PAIR(F_SOCK));
-		mvaddstr(xlines - 2, 0, "Filter: ");
+		mvaddstr(xlines - 2, 0, ftlabels[ptab->ftmode]);
 		addnstr(ptab->filt, xcols - 8);
 		addch(' ' | (ptab->ftlen > 0 ? A_REVERSE : 0));
 	}
@@ -2046,35 +4594,107 @@ static void redraw(const char *path)
 		addch(' ' | A_REVERSE);
 	}
 
-	// Draw scroll indicator
-	sp = MAX(1, ndents);
-	n = (sp <= onscr) ? onscr
-		: ((onscr * onscr << 1) / sp + 1) >> 1; // indicator height, round a/b by (a*2/b+1)/2
-	n = MAX(1, n);
-	sp = (curscroll == 0 || sp <= onscr) ? 1
-		: 1 + (((curscroll * (onscr - n) << 1) / (sp - onscr) + 1) >> 1); // starting row to drawing
-	attrset(COLOR_PAIR(C_DETAIL));
-	mvaddch(1, xcols - 1, '=');
-	while (--n >= 0)
-		mvaddch(++sp, xcols - 1, ' ' | A_REVERSE);
-	mvaddch(xlines - 2, xcols - 1, '=');
+	// Print jump prompt and the selected match
+	if (jplen > 0) {
+		move(xlines - 2, 0);
+		clrtoeol();
+		attrset(COLOR_PAIR(F_EXEC));
+		addstr("Jump: ");
+		addnstr(jumpstr, xcols - 8);
+		addch(' ' | A_REVERSE);
+		attrset(COLOR_PAIR(F_DIR));
+		if (njumpres == 0)
+			addstr("  no match");
+		else if ((n = xcols - getcurx(stdscr) - 8) > 0) {
+			printw("  %d/%d ", jumpsel + 1, njumpres);
+			addwstr(fitpathcols(pjumpres[jumpsel], n));
+		}
+	}
+
+	drawscrollbar(FALSE);
+	drawnscroll = curscroll;
 	gcfg.redrawn = 1; // set to skip fastredraw
 }
 
+/* Scroll the entry rows by the change of curscroll since the last draw, and only
+   print the rows that are exposed. Returns FALSE if a full redraw is needed. */
+static int scrollview(void)
+{
+	int delta = curscroll - drawnscroll, sta, end;
+
+	if (delta >= onscr || -delta >= onscr || gcfg.refresh
+	|| ptab->ftlen != 0 || ptab->fdlen > 0 || jplen > 0 || ncols <= 0)
+		return FALSE;
+	if (delta == 0) // Scrolled back by coalesced keys
+		return TRUE;
+
+	setscrreg(2, onscr + 1);
+	scrollok(stdscr, TRUE);
+	scrl(delta);
+	scrollok(stdscr, FALSE);
+	setscrreg(0, xlines - 1);
+
+	sta = (delta > 0) ? curscroll + onscr - delta : curscroll;
+	end = MIN((delta > 0) ? curscroll + onscr : curscroll - delta, ndents);
+	for (int i = sta; i < end; ++i) {
+		move(2 + i - curscroll, 0);
+		clrtoeol();
+		printent(&pdents[i], i == cursel, i == markent);
+	}
+
+	attrset(COLOR_PAIR(C_DETAIL));
+	mvaddstr(1, namecolx, curscroll > 0 ? "<<" : "  ");
+	mvaddstr(xlines - 2, namecolx, curscroll + onscr < ndents ? ">>" : "  ");
+	drawscrollbar(TRUE);
+	drawnscroll = curscroll;
+	return TRUE;
+}
+
 static void fastredraw(void)
 {
+	int lo = MIN(dirtylo, cursel), hi = MAX(dirtyhi, cursel);
+
+	dirtylo = INT_MAX;
+	dirtyhi = -1;
 	if (gcfg.redrawn || ndents == 0) { // bypass fastredraw after a full redraw
 		gcfg.redrawn = 0;
 		return;
 	}
-	if (lastsel >= curscroll && lastsel < onscr + curscroll && lastsel < ndents && lastsel != cursel) {
-		move(2 + lastsel - curscroll, 0);
-		printent(&pdents[lastsel], FALSE, lastsel == markent);
+	if (hi < 0 || lo == hi) { // Single step, only the old and new cursor rows changed
+		if (lastsel >= curscroll && lastsel < onscr + curscroll && lastsel < ndents && lastsel != cursel) {
+			move(2 + lastsel - curscroll, 0);
+			printent(&pdents[lastsel], FALSE, lastsel == markent);
+		}
+		lo = hi = cursel;
+	}
+	// Rows touched by coalesced keys
+	for (int i = MAX(lo, curscroll); i <= MIN(hi, MIN(onscr + curscroll, ndents) - 1); ++i) {
+		move(2 + i - curscroll, 0);
+		printent(&pdents[i], i == cursel, i == markent);
 	}
-	if (cursel >= curscroll && cursel < onscr + curscroll) {
-		move(2 + cursel - curscroll, 0);
-		printent(&pdents[cursel], TRUE, cursel == markent);
+}
+
+/* While more keys are queued, remember the drawing ctl needs and return GO_NONE to
+   handle them first. Otherwise return the strongest drawing remembered, which is
+   also how GO_NONE collects it once the queue is empty. */
+static int deferdraw(int ctl)
+{
+	static int pend = GO_NONE;
+	int c;
+
+	timeout(0);
+	c = getch();
+	timeout(-1);
+	if (c != ERR) {
+		ungetch(c);
+		pend = MAX(pend, ctl);
+		dirtylo = MIN(dirtylo, MIN(lastsel, cursel));
+		dirtyhi = MAX(dirtyhi, MAX(lastsel, cursel));
+		return GO_NONE;
 	}
+	ctl = MAX(pend, ctl);
+	pend = GO_NONE;
+	return ctl;
 }
 
 static void statusbar(void)
@@ -2091,8 +4711,25 @@ static void statusbar(void)
 
 	attrset(COLOR_PAIR(gcfg.runmode != 0 ? C_WARN : C_STATBAR));
 	printw("%d/%d ", ndents > 0 ? cursel + 1 : 0, ndents);
+	if (findfd != -1 && gcfg.ct == TABS_MAX)
+		printw("(%d results, searching) ", nfindres);
+	if (cpfd != -1) {
+		printw("(%s %u/%u", cpkind == 'c' ? "copying" : cpkind == 'm' ? "moving" : cpkind == 'd' ? "deleting" : "changing",
+			cpfiles[0], cpfiles[1]);
+		if (cpkind == 'c' || cpkind == 'm') {
+			printw(", %s", tohumansize(cpbytes[0]));
+			printw("/%s", tohumansize(cpbytes[1]));
+		}
+		printw(") ");
+	}
 	attron(A_REVERSE);
 	printw(" %d ", (ndents > 0 && !ptab->cfg.mansel) ? 1 : ptab->nsel);
+	if (ptab->cfg.mansel && ptab->nsel > 0) { // Selected counts per type and total size, '+' while sizing directories
+		for (int i = 0; i < 4; ++i)
+			if (ptab->selcnt[i] > 0)
+				printw("%d%c ", ptab->selcnt[i], "fdlo"[i]);
+		printw("%s%s ", tohumansize(ptab->selsize), ptab->selpend > 0 ? "+" : "");
+	}
 	attroff(A_REVERSE);
 
 	int n, x;
@@ -2100,14 +4737,13 @@ static void statusbar(void)
 		Entry *ent = &pdents[cursel];
 		printw("  %c%s %s:%s  %s", filetypechar(ent->type)[1], strperms(ent->mode),
 			getpwname(ent->uid), getgrname(ent->gid), tohumansize(ent->size));
-		printenttime(&ent->sec, FALSE);
+		addstr(fmttime(ent->sec, FALSE, gpbuf));
 
 		getyx(stdscr, n, x);
 		n = xcols - x;
-		if (ent->type == F_LNK && n > 1) {
-			char *p = &gpbuf[PATH_MAX * (sizeof(wchar_t) - 1) - 1]; // fitnamecols use gpbuf, so use last portion here
-			if ((x = readlink(ent->name, p, PATH_MAX - 1)) > 1) {
-				p[x] = '\0';
+		if ((ent->type == F_LNK || ent->type == F_ORPH) && n > 1) {
+			const char *p = getlinktarget(ent);
+			if (p) {
 				addstr("->");
 				addwstr(fitnamecols(p, n - 2)); // Show symlink target
 			}
@@ -2120,122 +4756,1296 @@ static void statusbar(void)
 			addch(' ');
 	}
 
-	getyx(stdscr, n, x);
-	if (xcols - x > 7)
-		mvaddstr(n, xcols - 7, "[?]help");
-}
+	getyx(stdscr, n, x);
+	if (xcols - x > 7)
+		mvaddstr(n, xcols - 7, "[?]help");
+}
+
+/* Score a case-insensitive subsequence match of pat (already lowercased) in str.
+   Returns INT_MIN if not matched. The scoring scheme follows fzf v1: rewards word
+   boundaries, path separators, camelCase and consecutive runs, penalizes gaps. */
+static int fuzzymatch(const char *str, const char *pat, int plen)
+{
+	enum { CC_WHITE = 0, CC_NONWORD, CC_DELIM, CC_LOWER, CC_UPPER, CC_LETTER, CC_NUMBER };
+	static unsigned char lowertb[256] = {0}, classtb[256] = {0};
+	const unsigned char *s = (const unsigned char *)str, *p = (const unsigned char *)pat;
+	const unsigned char *sta, *end, *pend = p + plen;
+	int score = 0, bonus, firstbonus = 0, consec = 0, ingap = 0, cls, prevcls;
+
+	if (lowertb[1] == 0) {
+		for (int i = 0; i < 256; ++i) {
+			lowertb[i] = i;
+			classtb[i] = (i > 127) ? CC_LETTER : CC_NONWORD;
+		}
+		for (int i = 'A'; i <= 'Z'; ++i) {
+			lowertb[i] = i + 32;
+			classtb[i] = CC_UPPER;
+			classtb[i + 32] = CC_LOWER;
+		}
+		for (int i = '0'; i <= '9'; ++i)
+			classtb[i] = CC_NUMBER;
+		classtb[' '] = classtb['\t'] = CC_WHITE;
+		classtb['/'] = classtb[','] = classtb[':'] = classtb[';'] = classtb['|'] = CC_DELIM;
+	}
+
+	// Forward scan for the end of the first match, then scan backward for the shortest one
+	for (; p < pend && *s; ++s)
+		if (lowertb[*s] == *p)
+			++p;
+	if (p < pend)
+		return INT_MIN;
+	for (end = sta = s; p > (const unsigned char *)pat; )
+		if (lowertb[*(--sta)] == p[-1])
+			--p;
+
+	prevcls = (sta == (const unsigned char *)str) ? CC_WHITE : classtb[sta[-1]];
+	for (s = sta; s < end; ++s, prevcls = cls) {
+		cls = classtb[*s];
+		if (lowertb[*s] != *p) {
+			score -= ingap ? 1 : 3; // gap extension and gap start penalties
+			ingap = 1;
+			consec = firstbonus = 0;
+			continue;
+		}
+
+		if (cls >= CC_LOWER) {
+			bonus = (prevcls == CC_WHITE) ? 10 : (prevcls == CC_DELIM) ? 9 : (prevcls == CC_NONWORD) ? 8
+				: ((prevcls == CC_LOWER && cls == CC_UPPER) || (prevcls != CC_NUMBER && cls == CC_NUMBER)) ? 7 : 0;
+		} else
+			bonus = (cls == CC_WHITE) ? 10 : 8;
+
+		if (consec == 0)
+			firstbonus = bonus;
+		else {
+			if (bonus >= 8 && bonus > firstbonus)
+				firstbonus = bonus;
+			bonus = MAX(MAX(bonus, firstbonus), 4); // consecutive bonus
+		}
+		score += 16 + ((p == (const unsigned char *)pat) ? bonus * 2 : bonus);
+		ingap = 0;
+		++consec;
+		++p;
+	}
+	return score;
+}
+
+/* Split the filter string into metadata query terms like "size>1G" and the name pattern.
+   Query strings point into tbuf. Returns the number of terms, including incomplete ones. */
+static int compilequery(const char *filt, Query *q, char *tbuf, char *pat)
+{
+	static const char *qkeys[] = {"size", "time", "type", "ext", "user", "group", "name"};
+	static const char *qops[] = {"<>=", "<>=", ":", ":", ":", ":", "~:"};
+	char *tok, *val, *end, *sp = NULL, *pp = pat;
+	int n = 0;
+	double num;
+
+	memccpy(tbuf, filt, '\0', FILT_MAX);
+	for (tok = strtok_r(tbuf, " ", &sp); tok; tok = strtok_r(NULL, " ", &sp)) {
+		int neg = (*tok == '!'), k = 0;
+		size_t klen = strcspn(tok + neg, "<>=:~");
+
+		while (k < (int)LENGTH(qkeys) && (strlen(qkeys[k]) != klen || strncasecmp(tok + neg, qkeys[k], klen) != 0))
+			++k;
+		if (k == (int)LENGTH(qkeys) || !tok[neg + klen] || !strchr(qops[k], tok[neg + klen]) || n == QUERY_MAX) {
+			if (pp != pat)
+				*pp++ = ' ';
+			pp = memccpy(pp, tok, '\0', FILT_MAX) - 1; // not a query term, part of the name pattern
+			continue;
+		}
+
+		val = tok + neg + klen + 1;
+		q[n] = (Query){.key = -1, .op = val[-1], .neg = neg, .num = 0, .str = val};
+		switch (k) {
+		case 0: // size
+		case 1: // time
+			num = strtod(val, &end);
+			if (end == val || (end[0] && (end[1] || !strchr(k == 0 ? "kKmMgGtT" : "smhdwy", end[0]))))
+				break;
+			if (k == 0 && *end)
+				num *= (double)(1LL << (10 * (strchr("kmgt", tolower((unsigned char)*end)) - "kmgt" + 1)));
+			else if (k == 1)
+				num *= (*end == 's') ? 1 : (*end == 'm') ? 60 : (*end == 'h') ? 3600
+					: (*end == 'w') ? 604800 : (*end == 'y') ? 31536000 : 86400; // default to days
+			q[n].num = (long long)num;
+			q[n].key = k;
+			break;
+		case 2: // type
+			if (val[0] && !val[1] && strchr("fdlcbpsx", val[0]))
+				q[n].key = k;
+			break;
+		case 4: // user
+		case 5: // group
+			if (!val[0])
+				break;
+			q[n].num = strtoll(val, &end, 10);
+			if (*end) // By name, unknown names match nothing
+				q[n].num = findidbyname(val, k == 5);
+			q[n].key = k;
+			break;
+		default: // ext, name
+			if (val[0] == '.' && k == 3)
+				q[n].str = ++val;
+			if (val[0])
+				q[n].key = k;
+		}
+		++n;
+	}
+
+	*pp = '\0';
+	if (n == 0)
+		memccpy(pat, filt, '\0', FILT_MAX); // plain filter, keep spaces as they are
+	return n;
+}
+
+static int matchquery(Entry *ent, const Query *q, int n)
+{
+	long long val;
+	const char *p;
+	int res;
+
+	for (int i = 0; i < n; ++i, ++q) {
+		switch (q->key) {
+		case 0: // size
+		case 1: // time
+			val = (q->key == 0) ? (long long)ent->size : (long long)(curtime - ent->sec);
+			res = (q->op == '<') ? val < q->num : (q->op == '>') ? val > q->num : val == q->num;
+			break;
+		case 2: // type
+			switch (q->str[0]) {
+			case 'f': res = (ent->flag & E_REG_FILE) != 0;
+				break;
+			case 'd': res = ent->type == F_DIR;
+				break;
+			case 'l': res = ent->type == F_LNK || ent->type == F_ORPH;
+				break;
+			case 'c': res = ent->type == F_CHR;
+				break;
+			case 'b': res = ent->type == F_BLK;
+				break;
+			case 'p': res = ent->type == F_IFO;
+				break;
+			case 's': res = ent->type == F_SOCK;
+				break;
+			default: res = ent->type == F_EXEC;
+			}
+			break;
+		case 3: // ext
+			resolvelink(ent);
+			p = (ent->flag & E_DIR_DIRLNK) ? NULL : getextension(ent->name, ent->nlen);
+			res = p && strcasecmp(p + 1, q->str) == 0;
+			break;
+		case 4: // user
+			res = (long long)ent->uid == q->num;
+			break;
+		case 5: // group
+			res = (long long)ent->gid == q->num;
+			break;
+		case 6: // name
+			res = strcasestr(ent->name, q->str) != NULL;
+			break;
+		default: // incomplete term
+			continue;
+		}
+		if (res == q->neg)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Get the longest ASCII literal that every match of a regex (ERE) or glob pattern contains.
+   Used to prefilter names with a substring scan before running the full matcher. */
+static char *requiredliteral(const char *pat, int isregex, char *buf)
+{
+	char run[FILT_MAX];
+	int c, lit, depth = 0, len = 0, best = 0;
+
+	buf[0] = '\0';
+	if (isregex && strchr(pat, '|'))
+		return buf; // alternation, no literal is required
+
+	for (const char *p = pat; ; ++p) {
+		c = *p;
+		lit = FALSE;
+		if (c == '[') { // skip bracket expression
+			p += (p[1] == '!' || p[1] == '^') ? 2 : 1;
+			if (!(p = strchr(*p == ']' ? p + 1 : p, ']')))
+				p = ""; // unterminated, stop here
+		} else if (c == '{' && isregex) { // skip interval expression
+			if (!(p = strchr(p, '}')))
+				p = "";
+		} else if (c == '\\' && p[1]) {
+			c = *(++p);
+			lit = !isregex || !isalnum(c);
+		} else if (isregex) {
+			depth += (c == '(') - (c == ')');
+			lit = c && !strchr(".()*+?{}^$", c);
+		} else
+			lit = c && c != '*' && c != '?';
+
+		if (isregex && *p && p[1] && strchr("*?{", p[1]))
+			lit = FALSE; // optional char
+		if (lit && depth == 0 && c > 0 && c < 128) {
+			run[len++] = c;
+			continue;
+		}
+		if (len > best) {
+			memcpy(buf, run, len);
+			buf[best = len] = '\0';
+		}
+		len = 0;
+		if (!*p)
+			break;
+	}
+	return buf;
+}
+
+/* Returns TRUE if the remaining entries should be ranked by fuzzy score */
+static int filterentry(void)
+{
+	Entry tmpent;
+	Query q[QUERY_MAX];
+	regex_t re;
+	char pat[FILT_MAX], tbuf[FILT_MAX], lit[FILT_MAX];
+	int nq, match, score, plen = 0, mode = ptab->ftmode;
+
+	if (ptab->ftlen == 0 || setfilter(2) == GO_REDRAW)
+		return FALSE;
+
+	if ((nq = compilequery(ptab->filt, q, tbuf, pat)) > 0 || mode == FM_REGEX || mode == FM_GLOB)
+		ndents = ptab->nde; // Results may grow while typing, filter all again
+
+	if (mode == FM_FUZZY) {
+		char *dst = pat;
+		for (const char *p = pat; *p; ++p)
+			if (*p != ' ')
+				*dst++ = (*p >= 'A' && *p <= 'Z') ? *p + 32 : *p;
+		*dst = '\0';
+		plen = dst - pat;
+	} else if (mode == FM_REGEX || mode == FM_GLOB) {
+		if (pat[0] == '\0' || (mode == FM_REGEX && regcomp(&re, pat, REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0))
+			mode = FM_SUBSTR; // Match incomplete regex literally while typing
+		else
+			requiredliteral(pat, mode == FM_REGEX, lit);
+	}
+
+	for (int i = 0; i < ndents; ++i) {
+		if (nq > 0 && !matchquery(&pdents[i], q, nq)) {
+			match = FALSE;
+		} else if (mode == FM_FUZZY) {
+			score = fuzzymatch(pdents[i].name, pat, plen);
+			match = (score != INT_MIN);
+			pdents[i].misc = match ? MAX(0, MIN(score + 1024, 65535)) : 0; // keep low scores positive
+		} else if (mode == FM_REGEX || mode == FM_GLOB) {
+			match = (lit[0] == '\0' || strcasestr(pdents[i].name, lit))
+				&& ((mode == FM_REGEX) ? regexec(&re, pdents[i].name, 0, NULL, 0)
+				: fnmatch(pat, pdents[i].name, FNM_CASEFOLD)) == 0;
+		} else
+			match = strcasestr(pdents[i].name, pat) != NULL;
+
+		if (!match && i != --ndents) {
+			tmpent = pdents[i];
+			pdents[i] = pdents[ndents];
+			pdents[ndents] = tmpent;
+			--i;
+		}
+	}
+
+	if (mode == FM_REGEX)
+		regfree(&re);
+	return plen > 0;
+}
+
+static void sortentries(int ranked)
+{
+	int (*cmp)(const void *, const void *) = ptab->cfg.reverse ? &reventrycmp : &entrycmp;
+
+	if (ranked)
+		cmp = &scoreentrycmp; // rank by fuzzy score
+	if (ptab->cfg.dirontop || ptab->cfg.sortby == 3) { // Order depends on which links point to directories
+		int npend = 0;
+		for (int i = 0; i < ndents; ++i)
+			npend += !!(pdents[i].flag & E_LNK_PEND);
+		if (npend > LNK_SYNC && !hlpcwd) // Sorted as files until the link worker is done
+			startlnkworker();
+		else
+			for (int i = 0; i < ndents && npend > 0; ++i)
+				resolvelink(&pdents[i]);
+	}
+	qsort(pdents, ndents, sizeof(*pdents), cmp);
+}
+
+static int filterinput(int c)
+{
+	if (ptab->ftlen <= 0) // ftlen=0 no filter, ftlen<0 inactive, ftlen>0 active
+		return GO_NONE;
+
+	if (c == '/') { // turn off filter
+		setfilter(0);
+		return refreshview(2);
+	} else if (c == '\r' || c == ESC){ // set to inactive
+		ptab->ftlen = (ptab->filt[0] == '\0') ? 0 : -ptab->ftlen;
+		return GO_REDRAW;
+
+	} else if (c == '\t') { // switch filter mode
+		ptab->ftmode = (ptab->ftmode + 1) % FM_NUM;
+		ndents = ptab->nde;
+
+	} else if (c == KEY_BACKSPACE || c == KEY_DC || c == 127) {
+		if (ptab->ftlen <= 1)
+			return GO_REDRAW;
+		char *end = ptab->filt + ptab->ftlen - 1;
+		while (--end >= ptab->filt && (*end & 0xC0) == 0x80);
+		*end = '\0';
+		ptab->ftlen = end - ptab->filt + 1;
+		ndents = ptab->nde;
+
+	} else if (c > 31 && c < 256) {
+		ptab->filt[ptab->ftlen - 1] = c;
+		ptab->filt[ptab->ftlen == FILT_MAX - 1 ? ptab->ftlen : ++ptab->ftlen - 1] = '\0';
+	} else
+		return GO_NONE;
+
+	if (ptab->ftmode == FM_FUZZY) { // ranked results, keep cursor on the best match
+		ptab->hp->stat->cur = ptab->hp->stat->scrl = 0;
+		return GO_SORT;
+	}
+	return refreshview(2);
+}
+
+static int qfindinput(int c)
+{
+	if (ptab->fdlen <= 0) // fdlen=0 no quick find, fdlen<0 invisible, fdlen>0 active
+		return GO_NONE;
+
+	if (c == '\r' || c == ESC) { // turn of or set to invisible
+		ptab->fdlen = (ptab->find[0] == '\0') ? 0 : -ptab->fdlen;
+		return GO_REDRAW;
+
+	} else if (c == '/' && ptab->find[0] == '\0') { // go to root dir
+		ptab->fdlen = 1;
+		newhistpath("/", FALSE);
+		return GO_RELOAD;
+
+	} else if (c == '\t' || c == '/') { // enter dir
+		if (enterdir(0) != GO_RELOAD)
+			return GO_REDRAW;
+		ptab->find[0] = '\0';
+		ptab->fdlen = 1;
+		return GO_RELOAD;
+
+	} else if (c == KEY_BACKSPACE || c == KEY_DC || c == 127) {
+		if (ptab->fdlen <= 1)
+			return GO_REDRAW;
+		char *end = ptab->find + ptab->fdlen - 1;
+		while (--end >= ptab->find && (*end & 0xC0) == 0x80);
+		*end = '\0';
+		ptab->fdlen = end - ptab->find + 1;
+
+	} else if (c > 31 && c < 256) {
+		ptab->find[ptab->fdlen - 1] = c;
+		ptab->find[ptab->fdlen == FILT_MAX - 1 ? ptab->fdlen : ++ptab->fdlen - 1] = '\0';
+	} else
+		return GO_NONE;
+
+	if (ptab->find[0] == '\0')
+		return GO_REDRAW;
+
+	int i = findprefix(ptab->find, ptab->fdlen - 1);
+	if (i >= 0) {
+		cursel = i;
+		curscroll = MAX(i - (onscr * 3 >> 2), MIN(i - (onscr >> 2), curscroll));
+		return GO_REDRAW;
+	}
+	return qfindnext(0);
+}
+
+/* Ask the terminal whether it supports synchronized output (DEC mode 2026). The
+   DA1 query is sent after it, so terminals that ignore DECRQM still end the reply. */
+static int querysyncout(void)
+{
+	static const char seq[] = "\033[?2026$p\033[c";
+	struct termios oldt, t;
+	char buf[128], *p;
+	int fd, len = 0, ret = FALSE;
+
+	if (!isatty(STDOUT_FILENO) || (fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1)
+		return FALSE;
+	if (tcgetattr(fd, &oldt) == -1) {
+		close(fd);
+		return FALSE;
+	}
+	t = oldt;
+	t.c_lflag &= ~(ICANON | ECHO);
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &t);
+
+	if (write(fd, seq, sizeof(seq) - 1) == sizeof(seq) - 1) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		while (len < (int)sizeof(buf) - 1 && poll(&pfd, 1, 200) > 0) {
+			ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+			if (n <= 0)
+				break;
+			buf[len += n] = '\0';
+			if ((p = strstr(buf, "\033[?")) && strchr(p + 3, 'c') && !strstr(p, "2026;"))
+				break; // DA1 reply without DECRQM reply
+			if ((p = strstr(buf, "\033[?2026;")) && strstr(p, "$y")) {
+				ret = (p[8] == '1' || p[8] == '2');
+				break;
+			}
+		}
+	}
+
+	tcsetattr(fd, TCSAFLUSH, &oldt); // Drop the rest of replies
+	close(fd);
+	return ret;
+}
+
+/* Send the pending frame, wrapped in a synchronized update where supported */
+static void flushframe(void)
+{
+	if (!syncout || !is_wintouched(stdscr))
+		return;
+	putp("\033[?2026h");
+	fflush(stdout); // putp goes through stdio, the frame does not
+	refresh();
+	putp("\033[?2026l");
+	fflush(stdout);
+}
+
+/*
+ * Visited directories: an index of records sorted by path, mapped read-only, and a log of
+ * visits since it was built. The index is DIRDB_MAGIC, the number of records, the sizes of the
+ * path block and of the basename block, the records, the paths, and the last components of
+ * the paths in lowercase. Queries only scan the basename block, which is a fraction of the
+ * paths. Log records are '+' for a visit or '-' for a path that is gone, the time, a space
+ * and the path, ended by NUL.
+ */
+static int finddirrec(const char *path)
+{
+	int lo = 0, hi = (int)ndirrec - 1, mid, cmp;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if ((cmp = strcmp(pdirpath + pdirrec[mid].off, path)) == 0)
+			return mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+static void adddirvisit(const char *path, unsigned int t, int forget)
+{
+	unsigned int h = hashstr(path), i;
+	struct dirvisit *dv;
+
+	for (i = 0; i < ndirvisit && (pdirvisit[i].hash != h || strcmp(pdirvisit[i].path, path) != 0); ++i)
+		;
+	if (i == ndirvisit) {
+		if (ndirvisit == dirvisitcap) {
+			unsigned int cap = MAX(64, dirvisitcap * 2);
+			struct dirvisit *tmp = realloc(pdirvisit, cap * sizeof(struct dirvisit));
+			if (!tmp)
+				return;
+			pdirvisit = tmp;
+			dirvisitcap = cap;
+		}
+		dv = &pdirvisit[i];
+		if (!(dv->path = strdup(path)))
+			return;
+		dv->hash = h;
+		dv->count = 0;
+		dv->reset = FALSE;
+		dv->last = 0;
+		if ((dv->idx = finddirrec(path)) >= 0)
+			pdirseen[dv->idx >> 3] |= 1 << (dv->idx & 7);
+		++ndirvisit;
+	}
+
+	dv = &pdirvisit[i];
+	if (forget) {
+		dv->count = 0;
+		dv->reset = TRUE;
+	} else {
+		++dv->count;
+		dv->last = t;
+	}
+}
+
+static void readdirlog(const char *path)
+{
+	struct stat sb;
+	char *map, *end, *sep;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0
+	|| (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	// A record cut short by a full disk or a crash ends the log
+	for (char *p = map; (end = memchr(p, '\0', map + sb.st_size - p)); p = end + 1) {
+		unsigned int t = strtoul(p + 1, &sep, 10);
+		if ((*p == '+' || *p == '-') && *sep == ' ' && sep[1] == '/')
+			adddirvisit(sep + 1, t, *p == '-');
+	}
+	munmap(map, sb.st_size);
+}
+
+static void mapdirdb(const char *path)
+{
+	struct stat sb;
+	unsigned int hdr[3];
+	size_t size;
+	char *map;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || sb.st_size < 20
+	|| (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	memcpy(hdr, map + 8, sizeof(hdr));
+	size = 20 + (size_t)hdr[0] * sizeof(struct dirrec) + hdr[1] + hdr[2];
+	if (memcmp(map, DIRDB_MAGIC, 8) != 0 || size != (size_t)sb.st_size
+	|| (hdr[0] > 0 && (map[size - hdr[2] - 1] != '\0' || map[size - 1] != '\0'))
+	|| !(pdirseen = calloc(hdr[0] / 8 + 1, 1))) {
+		munmap(map, sb.st_size);
+		return;
+	}
+
+	pdirmap = map;
+	dirmaplen = sb.st_size;
+	pdirrec = (struct dirrec *)(map + 20);
+	pdirpath = map + size - hdr[1] - hdr[2];
+	pdirbase = map + size - hdr[2];
+	dirpathlen = hdr[1];
+	dirbaselen = hdr[2];
+	for (ndirrec = 0; ndirrec < hdr[0] && pdirrec[ndirrec].off < dirpathlen && pdirrec[ndirrec].boff < dirbaselen; ++ndirrec)
+		;
+}
+
+static void freedirdb(void)
+{
+	for (unsigned int i = 0; i < ndirvisit; ++i)
+		free(pdirvisit[i].path);
+	free(pdirvisit);
+	free(pdirseen);
+	if (pdirmap)
+		munmap(pdirmap, dirmaplen);
+	pdirvisit = NULL;
+	pdirseen = NULL;
+	pdirmap = NULL;
+	ndirvisit = dirvisitcap = ndirrec = dirpathlen = dirbaselen = 0;
+}
+
+static int cmpdirvisit(const void *a, const void *b)
+{
+	return strcmp((*(struct dirvisit *const *)a)->path, (*(struct dirvisit *const *)b)->path);
+}
+
+/* Write a new index from the current one and the logged visits. Counts are aged when their
+   total grows over DIRDB_AGING, so old visits fade and paths not visited for long drop out. */
+static int writedirdb(const char *path)
+{
+	struct dirvisit **pv = malloc((ndirvisit + 1) * sizeof(struct dirvisit *));
+	struct dirrec *recs = malloc((ndirrec + ndirvisit + 1) * sizeof(struct dirrec));
+	size_t blen = dirpathlen + 1, off = 0, boff = 0;
+	unsigned long long total = 0;
+	unsigned int n = 0, i = 0, j = 0, hdr[3];
+	char tmp[PATH_MAX], *blk;
+	int fd, ok = FALSE;
+
+	for (i = 0; i < ndirvisit; ++i) {
+		blen += strlen(pdirvisit[i].path) + 1;
+		total += pdirvisit[i].count;
+	}
+	for (i = 0; i < ndirrec; ++i)
+		total += pdirrec[i].count;
+	if (!pv || !recs || !(blk = malloc(blen * 2))) { // Basenames go in the second half
+		free(pv);
+		free(recs);
+		return FALSE;
+	}
+
+	for (i = 0; i < ndirvisit; ++i)
+		pv[i] = &pdirvisit[i];
+	qsort(pv, ndirvisit, sizeof(struct dirvisit *), cmpdirvisit);
+
+	// Merge both in path order, a visit adding to the index record of its path or replacing a forgotten one
+	for (i = 0; i < ndirrec || j < ndirvisit; ) {
+		const char *src = (i < ndirrec) ? pdirpath + pdirrec[i].off : NULL;
+		int cmp = !src ? 1 : (j == ndirvisit) ? -1 : strcmp(src, pv[j]->path);
+		struct dirrec r;
+		size_t len;
+
+		if (cmp < 0) {
+			r = pdirrec[i++];
+		} else {
+			r.count = pv[j]->count;
+			r.last = pv[j]->last;
+			if (cmp == 0 && !pv[j]->reset) {
+				r.count += pdirrec[i].count;
+				r.last = MAX(r.last, pdirrec[i].last);
+			}
+			i += (cmp == 0);
+			src = pv[j++]->path;
+		}
+		if (total > DIRDB_AGING)
+			r.count = r.count * 9 / 10;
+		if (r.count == 0)
+			continue;
+
+		len = strlen(src) + 1;
+		memcpy(blk + off, src, len);
+		r.off = off;
+		r.boff = boff;
+		recs[n++] = r;
+		off += len;
+		for (const char *c = strrchr(src, '/'); *c++; ++boff)
+			blk[blen + boff] = (*c & 0x80) ? *c : tolower((unsigned char)*c);
+	}
+
+	hdr[0] = n;
+	hdr[1] = off;
+	hdr[2] = boff;
+	memccpy(tmp, path, '\0', PATH_MAX - 12);
+	strcat(strcat(tmp, "."), xitoa(getpid()));
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1) {
+		ok = writeall(fd, DIRDB_MAGIC, 8) && writeall(fd, (char *)hdr, sizeof(hdr))
+		&& writeall(fd, (char *)recs, n * sizeof(struct dirrec)) && writeall(fd, blk, off) && writeall(fd, blk + blen, boff);
+		close(fd);
+		if (!ok || rename(tmp, path) == -1) {
+			unlink(tmp);
+			ok = FALSE;
+		}
+	}
+	free(pv);
+	free(recs);
+	free(blk);
+	return ok;
+}
+
+/* Map the index of visited directories and read the log. A log grown over DIRDB_LOGMAX is
+   merged into a new index first, other instances keep theirs mapped until they restart. */
+static void loaddirdb(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct stat sb;
+
+	if (!cfgpath || !makecfgdir() || !makepath(cfgpath, DIRDB_FILE, path) || !(dirlogpath = malloc(strlen(path) + 5)))
+		return;
+	strcat(strcpy(dirlogpath, path), ".log");
+	mapdirdb(path);
+	if (stat(dirlogpath, &sb) == -1 || sb.st_size <= DIRDB_LOGMAX) {
+		readdirlog(dirlogpath);
+		return;
+	}
+
+	// Move the log aside so visits logged meanwhile go to a new one
+	strcat(strcat(strcpy(tmp, dirlogpath), "."), xitoa(getpid()));
+	if (rename(dirlogpath, tmp) == -1) {
+		readdirlog(dirlogpath);
+		return;
+	}
+	readdirlog(tmp);
+	if (!writedirdb(path)) {
+		rename(tmp, dirlogpath);
+		return;
+	}
+	unlink(tmp);
+	freedirdb();
+	mapdirdb(path);
+	readdirlog(dirlogpath);
+}
+
+/* Log a visit to path, or that it is gone. Repeated visits to the same path count once. */
+static void recorddir(const char *path, int forget)
+{
+	static char lastpath[PATH_MAX];
+	char rec[PATH_MAX + 16], *p = rec;
+	unsigned int now = time(NULL);
+	int fd;
+
+	if (!dirlogpath || (!forget && strcmp(lastpath, path) == 0))
+		return;
+	memccpy(lastpath, forget ? "" : path, '\0', PATH_MAX);
+
+	*p++ = forget ? '-' : '+';
+	p = (char *)memccpy(p, xitoa(now), '\0', 12) - 1;
+	*p++ = ' ';
+	p = memccpy(p, path, '\0', PATH_MAX);
+	if ((fd = open(dirlogpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) != -1) {
+		writeall(fd, rec, p - rec); // One write, so records of other instances do not interleave
+		close(fd);
+	}
+	adddirvisit(path, now, forget);
+}
+
+/* Frecency of a directory: its visits weighted by how recent the last one is */
+static unsigned long long dirscore(unsigned int count, unsigned int last, unsigned int now)
+{
+	long long age = (long long)now - last;
+
+	return (unsigned long long)count * (age < 3600 ? 16 : age < 86400 ? 8 : age < 604800 ? 2 : 1);
+}
+
+/* Whether the fragments are all in path in this order, the last one in its last component */
+static int matchfrags(const char *path, char **frag, int nfrag, int icase)
+{
+	const char *p = path;
+
+	for (int i = 0; i < nfrag; ++i) {
+		if (!(p = icase ? strcasestr(p, frag[i]) : strstr(p, frag[i])))
+			return FALSE;
+		p += strlen(frag[i]);
+	}
+	if (nfrag == 0)
+		return TRUE;
+	p = strrchr(path, '/');
+	return (icase ? strcasestr(p, frag[nfrag - 1]) : strstr(p, frag[nfrag - 1])) != NULL;
+}
+
+static void addjumpres(const char *path, unsigned long long s, unsigned long long *score)
+{
+	int i = (njumpres < JUMP_MAX) ? njumpres++ : JUMP_MAX;
+
+	for (; i > 0 && score[i - 1] < s; --i) {
+		if (i < JUMP_MAX) {
+			pjumpres[i] = pjumpres[i - 1];
+			score[i] = score[i - 1];
+		}
+	}
+	if (i < JUMP_MAX) {
+		pjumpres[i] = path;
+		score[i] = s;
+	}
+}
+
+/* Find the best JUMP_MAX directories for the fragments of jumpstr, separated by spaces or
+   slashes. They have to be in the path in order, the last one in its last component. Case is
+   ignored unless they have uppercase. */
+static void matchdirs(void)
+{
+	char buf[FILT_MAX], key[FILT_MAX], *frag[FILT_MAX / 2];
+	unsigned long long score[JUMP_MAX];
+	unsigned int now = time(NULL);
+	size_t klen = 0;
+	int nfrag = 0, icase = TRUE;
+
+	njumpres = jumpsel = 0;
+	memcpy(buf, jumpstr, FILT_MAX);
+	for (char *p = strtok(buf, " /"); p; p = strtok(NULL, " /")) {
+		for (char *q = p; *q && icase; ++q)
+			icase = !isupper((unsigned char)*q);
+		frag[nfrag++] = p;
+	}
+	if (nfrag > 0) { // The basename block is in lowercase
+		for (klen = 0; frag[nfrag - 1][klen]; ++klen)
+			key[klen] = tolower((unsigned char)frag[nfrag - 1][klen]);
+	}
+
+	for (unsigned int i = 0; i < ndirvisit; ++i) {
+		const struct dirvisit *dv = &pdirvisit[i];
+		unsigned int count = dv->count, last = dv->last;
+
+		if (dv->idx >= 0 && !dv->reset) {
+			count += pdirrec[dv->idx].count;
+			last = MAX(last, pdirrec[dv->idx].last);
+		}
+		if (count > 0 && matchfrags(dv->path, frag, nfrag, icase))
+			addjumpres(dv->path, dirscore(count, last, now), score);
+	}
+
+	// Only records that can make it to the results are matched against all fragments
+	for (unsigned int i = 0; i < ndirrec; ++i) {
+		const char *p;
+		unsigned long long s;
+
+		if (nfrag > 0) {
+			if (!(p = memmem(pdirbase + pdirrec[i].boff, dirbaselen - pdirrec[i].boff, key, klen)))
+				break;
+			for (size_t off = p - pdirbase; i + 1 < ndirrec && pdirrec[i + 1].boff <= off; ++i)
+				;
+		}
+		if (pdirseen[i >> 3] & (1 << (i & 7)))
+			continue;
+		s = dirscore(pdirrec[i].count, pdirrec[i].last, now);
+		if ((njumpres < JUMP_MAX || s > score[JUMP_MAX - 1]) && matchfrags(pdirpath + pdirrec[i].off, frag, nfrag, icase))
+			addjumpres(pdirpath + pdirrec[i].off, s, score);
+	}
+}
+
+static int jumpdir(int n __attribute__((unused)))
+{
+	if (gcfg.ct == TABS_MAX)
+		return GO_NONE;
+	jumpstr[0] = '\0';
+	jplen = 1;
+	matchdirs();
+	return GO_REDRAW;
+}
+
+static int jumpinput(int c)
+{
+	if (jplen <= 0)
+		return GO_NONE;
+
+	if (c == ESC) {
+		jplen = 0;
+		return GO_REDRAW;
+
+	} else if (c == '\r' || c == KEY_ENTER) {
+		int ctl = GO_NONE;
+		jplen = 0;
+		if (njumpres > 0 && (ctl = newhistpath(pjumpres[jumpsel], FALSE)) == GO_STATBAR
+		&& (errnum == ENOENT || errnum == ENOTDIR))
+			recorddir(pjumpres[jumpsel], TRUE);
+		return (ctl == GO_RELOAD) ? GO_RELOAD : GO_REDRAW;
+
+	} else if (c == '\t' || c == KEY_BTAB) { // cycle through matches
+		if (njumpres > 0)
+			jumpsel = (jumpsel + (c == '\t' ? 1 : njumpres - 1)) % njumpres;
+		return GO_REDRAW;
+
+	} else if (c == KEY_BACKSPACE || c == KEY_DC || c == 127) {
+		if (jplen <= 1)
+			return GO_REDRAW;
+		char *end = jumpstr + jplen - 1;
+		while (--end >= jumpstr && (*end & 0xC0) == 0x80);
+		*end = '\0';
+		jplen = end - jumpstr + 1;
+
+	} else if (c > 31 && c < 256) {
+		jumpstr[jplen - 1] = c;
+		jumpstr[jplen == FILT_MAX - 1 ? jplen : ++jplen - 1] = '\0';
+	} else
+		return GO_NONE;
+
+	matchdirs();
+	return GO_REDRAW;
+}
+
+/* Load (GO_RELOAD) or filter and sort again (GO_SORT) the entries of the current tab */
+static void reloadview(int ctl)
+{
+	if (ctl == GO_RELOAD) {
+		ptab = &gtab[gcfg.ct];
+		loadentries(ptab->hp->path);
+		if (ptab->hp->stat->flag != S_ROOT) // Not search results
+			recorddir(ptab->hp->path, FALSE);
+	}
+	sortentries(filterentry());
+	resetindex();
+	setcurrentstat(ptab->hp);
+}
+
+/* Listen on a UNIX socket in cfgpath for control commands. Its path is given to detached
+   children only, as sff cannot serve the socket while it waits for the others. */
+static void initctlsock(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	size_t len;
+
+	for (int i = 0; i < CTL_MAX; ++i)
+		ctlconn[i].fd = -1;
+	if (!cfgpath || !makecfgdir() || !makepath(cfgpath, ".sff-sock.", gpbuf))
+		return;
+	strcat(gpbuf, xitoa(getpid()));
+	if ((len = strlen(gpbuf)) >= sizeof(addr.sun_path) && seterrnum(__LINE__, ENAMETOOLONG))
+		return;
+	memcpy(addr.sun_path, gpbuf, len + 1);
+
+	if ((ctlfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 && seterrnum(__LINE__, errno))
+		return;
+	unlink(gpbuf); // Left by a crashed instance with the same pid
+	if (bind(ctlfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(ctlfd, CTL_MAX) == -1) {
+		seterrnum(__LINE__, errno);
+		close(ctlfd);
+		ctlfd = -1;
+		return;
+	}
+	fcntl(ctlfd, F_SETFD, FD_CLOEXEC);
+	fcntl(ctlfd, F_SETFL, O_NONBLOCK);
+	sockpath = strdup(gpbuf);
+}
+
+static void closectl(struct ctlconn *cc)
+{
+	free(cc->res);
+	cc->res = NULL;
+	cc->reslen = cc->rescap = 0;
+	close(cc->fd);
+	cc->fd = -1;
+}
+
+/* Accept clients of the control socket. When all CTL_MAX slots are taken, the client silent
+   for longest is dropped if it has been idle for CTL_IDLE, otherwise the new one is turned away. */
+static int acceptctl(void)
+{
+	int fd, i, old;
+
+	while ((fd = accept(ctlfd, NULL, NULL)) != -1) {
+		for (i = old = 0; i < CTL_MAX && ctlconn[i].fd != -1; ++i)
+			if (ctlconn[i].seen < ctlconn[old].seen)
+				old = i;
+		if (i == CTL_MAX) {
+			if (monotime() - ctlconn[old].seen < CTL_IDLE * 1000LL) {
+				close(fd);
+				continue;
+			}
+			closectl(&ctlconn[i = old]);
+		}
+		// Reads happen only when poll says so, replies may block for a second at most
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){.tv_sec = 1}, sizeof(struct timeval));
+		ctlconn[i].fd = fd;
+		ctlconn[i].seen = monotime();
+		ctlconn[i].len = ctlconn[i].reslen = 0;
+	}
+	return GO_NONE;
+}
+
+/* Run one control command. ctl is the drawing needed by the commands before it in the batch,
+   returns the drawing needed after this one. */
+static int runctlcmd(struct ctlconn *cc, char *cmd, int ctl)
+{
+	char *arg = cmd + 1;
+	size_t len;
+	int i, ret = GO_NONE;
+
+	// Let commands after a change of directory see the new listing
+	if (ctl >= GO_SORT && *cmd && strchr("@+-lc", *cmd)) {
+		reloadview(ctl);
+		ctl = GO_REDRAW;
+	}
+
+	switch (*cmd) {
+	case '.': // clear selection
+		ret = clearselection(0);
+		break;
+
+	case '*': // refresh, '*.' also clears selection
+		if (*arg == '.')
+			clearselection(0);
+		ret = refreshview(0);
+		break;
 
-static void filterentry(void)
-{
-	Entry tmpent;
+	case '@': // move to specified file
+		memccpy(ptab->hp->stat->name, xbasename(arg), '\0', NAME_MAX);
+		findname = ptab->hp->stat->name;
+		ptab->hp->stat->cur = cursel;
+		ptab->hp->stat->scrl = curscroll;
+		ret = GO_RELOAD;
+		break;
 
-	if (ptab->ftlen == 0 || setfilter(2) == GO_REDRAW)
-		return;
+	case '>': // enter specified path
+		if (arg[0] == '/')
+			ret = newhistpath(arg, FALSE);
+		break;
 
-	for (int i = 0; i < ndents; ++i) {
-		if (!strcasestr(pdents[i].name, ptab->filt) && i != --ndents) {
-			tmpent = pdents[i];
-			pdents[i] = pdents[ndents];
-			pdents[ndents] = tmpent;
-			--i;
+	case '+': // select or deselect a file of the current directory, given by name or path
+	case '-':
+		len = strlen(ptab->hp->path);
+		if (arg[0] == '/' && strncmp(arg, ptab->hp->path, len) == 0 && arg[len - (len == 1)] == '/')
+			arg += len + (len > 1);
+		if ((i = findentry(arg)) < 0)
+			break;
+		if (*cmd == '+')
+			appendselection(&pdents[i]);
+		else if (pdents[i].flag & E_SEL)
+			removeselection(&pdents[i]);
+		ret = GO_REDRAW;
+		break;
+
+	case '#': // set preview
+		if (*arg == 'p')
+			setpreview(0);
+		else if (*arg == 'q')
+			setpreview(2);
+		ret = GO_FASTDRAW;
+		break;
+
+	case '?': // search result, loaded when the client is done
+		len = strlen(arg) + 1;
+		if (cc->reslen + len + 1 > cc->rescap) {
+			size_t cap = MAX(cc->rescap * 2, cc->reslen + len + NAME_INCR);
+			char *tmp = realloc(cc->res, cap);
+			if (!tmp && seterrnum(__LINE__, errno))
+				return MAX(ctl, GO_STATBAR);
+			cc->res = tmp;
+			cc->rescap = cap;
 		}
+		memcpy(cc->res + cc->reslen, arg, len);
+		cc->reslen += len;
+		break;
+
+	// Queries, each answered with NUL-terminated records and an empty record
+	case 'p': // current directory
+		writeall(cc->fd, ptab->hp->path, strlen(ptab->hp->path) + 1);
+		writeall(cc->fd, "", 1);
+		break;
+	case 'c': // current entry
+		if (ndents > 0)
+			writeall(cc->fd, pdents[cursel].name, pdents[cursel].nlen);
+		writeall(cc->fd, "", 1);
+		break;
+	case 'l': // listed entries
+		for (i = 0; i < ndents && writeall(cc->fd, pdents[i].name, pdents[i].nlen); ++i)
+			;
+		writeall(cc->fd, "", 1);
+		break;
+	case 's': // selection, or the current entry if nothing is selected
+		writeselection(cc->fd);
+		writeall(cc->fd, "", 1);
 	}
+	return MAX(ctl, ret);
 }
 
-static int filterinput(int c)
+/* Run the complete commands a control client has sent. When it is done, load the
+   search results it pushed and close it. Returns the drawing needed. */
+static int readctlclient(struct ctlconn *cc)
 {
-	if (ptab->ftlen <= 0) // ftlen=0 no filter, ftlen<0 inactive, ftlen>0 active
+	ssize_t n = read(cc->fd, cc->buf + cc->len, sizeof(cc->buf) - cc->len);
+	int ctl = GO_NONE;
+	char *p = cc->buf, *end;
+
+	if (n == -1 && (errno == EINTR || errno == EAGAIN))
 		return GO_NONE;
 
-	if (c == '/') { // turn off filter
-		setfilter(0);
-		return refreshview(2);
-	} else if (c == '\r' || c == ESC){ // set to inactive
-		ptab->ftlen = (ptab->filt[0] == '\0') ? 0 : -ptab->ftlen;
-		return GO_REDRAW;
+	if (n > 0) {
+		cc->seen = monotime();
+		cc->len += n;
+		for (; (end = memchr(p, '\0', cc->buf + cc->len - p)); p = end + 1)
+			ctl = runctlcmd(cc, p, ctl);
+		cc->len -= p - cc->buf;
+		memmove(cc->buf, p, cc->len);
+		if (cc->len < sizeof(cc->buf)) // Otherwise the command is too long, drop the client
+			return ctl;
+	}
 
-	} else if (c == KEY_BACKSPACE || c == KEY_DC || c == 127) {
-		if (ptab->ftlen <= 1)
-			return GO_REDRAW;
-		char *end = ptab->filt + ptab->ftlen - 1;
-		while (--end >= ptab->filt && (*end & 0xC0) == 0x80);
-		*end = '\0';
-		ptab->ftlen = end - ptab->filt + 1;
-		ndents = ptab->nde;
+	if (cc->reslen > 0) {
+		if (ctl >= GO_SORT)
+			reloadview(ctl); // Results go to the search tab of the new current directory
+		cancelfind();
+		free(pfindbuf);
+		pfindbuf = cc->res;
+		pfindend = pfindbuf + cc->reslen;
+		*pfindend = '\0';
+		findlen = cc->reslen;
+		findcap = cc->rescap;
+		cc->res = NULL;
+		ctl = (inittab(ptab->hp->path, TABS_MAX) && switchtab(TABS_MAX) != GO_STATBAR) ? GO_RELOAD : GO_STATBAR;
+	}
+	closectl(cc);
+	return ctl;
+}
 
-	} else if (c > 31 && c < 256) {
-		ptab->filt[ptab->ftlen - 1] = c;
-		ptab->filt[ptab->ftlen == FILT_MAX - 1 ? ptab->ftlen : ++ptab->ftlen - 1] = '\0';
-	} else
+/* Add the results completed since the last call to the listing, if the search tab shows them */
+static int loadfindstream(void)
+{
+	char *from = pfindend, *end = pfindbuf ? memrchr(pfindbuf, '\0', findlen) : NULL;
+
+	if (!end || end + 1 == pfindend)
+		return (gcfg.ct == TABS_MAX) ? GO_STATBAR : GO_NONE;
+	pfindend = end + 1;
+	if (gcfg.ct != TABS_MAX || ptab->hp->stat->flag != S_ROOT)
 		return GO_NONE;
+
+	ndents = ptab->nde; // Appended after filtered out entries, filter all again
+	loadsrchentry(AT_FDCWD, from ? from : pfindbuf);
+	ptab->nde = ndents;
 	return refreshview(2);
 }
 
-static int qfindinput(int c)
+/* Read search results streamed in by an extension function. They are loaded
+   every FIND_DELAY ms while streaming, and right away when the stream ends. */
+static int readfindstream(void)
 {
-	if (ptab->fdlen <= 0) // fdlen=0 no quick find, fdlen<0 invisible, fdlen>0 active
-		return GO_NONE;
+	ssize_t len = 0;
 
-	if (c == '\r' || c == ESC) { // turn of or set to invisible
-		ptab->fdlen = (ptab->find[0] == '\0') ? 0 : -ptab->fdlen;
-		return GO_REDRAW;
+	for (int i = 0; i < 16 && findfd != -1; ++i) { // Don't starve the keyboard on a fast producer
+		if (findcap - findlen < NAME_INCR + 1) {
+			size_t cap = MAX(findcap * 2, NAME_INCR * 16), loaded = pfindend ? pfindend - pfindbuf : 0;
+			char *tmp = malloc(cap);
+			if (!tmp && seterrnum(__LINE__, errno)) {
+				cancelfind();
+				return GO_STATBAR;
+			}
+			if (findlen)
+				memcpy(tmp, pfindbuf, findlen);
+			if (loaded && gcfg.ct == TABS_MAX && ptab->hp->stat->flag == S_ROOT) {
+				for (int j = 0; j < ptab->nde; ++j) // Listed results point into the old buffer
+					pdents[j].name = tmp + (pdents[j].name - pfindbuf);
+				dispcols = -1;
+			}
+			free(pfindbuf);
+			pfindbuf = tmp;
+			pfindend = loaded ? tmp + loaded : NULL;
+			findcap = cap;
+		}
 
-	} else if (c == '/' && ptab->find[0] == '\0') { // go to root dir
-		ptab->fdlen = 1;
-		newhistpath("/", FALSE);
-		return GO_RELOAD;
+		if ((len = read(findfd, pfindbuf + findlen, findcap - findlen - 1)) <= 0)
+			break;
+		for (char *p = pfindbuf + findlen; (p = memchr(p, '\0', pfindbuf + findlen + len - p)); ++p)
+			++nfindres;
+		findlen += len;
+	}
 
-	} else if (c == '\t' || c == '/') { // enter dir
-		if (enterdir(0) != GO_RELOAD)
-			return GO_REDRAW;
-		ptab->find[0] = '\0';
-		ptab->fdlen = 1;
-		return GO_RELOAD;
+	if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+		if (!timerat[T_FINDLOAD])
+			settimer(T_FINDLOAD, FIND_DELAY);
+		return GO_NONE;
+	}
+	if (len == 0 || len == -1) { // End of stream, or the producer failed
+		cancelfind();
+		if (findlen > 0 && pfindbuf[findlen - 1] != '\0') { // Last result without a terminator
+			pfindbuf[findlen++] = '\0';
+			++nfindres;
+		}
+		return loadfindstream();
+	}
+	if (!timerat[T_FINDLOAD]) // More to read, poll says so again, but load what came so far in time
+		settimer(T_FINDLOAD, FIND_DELAY);
+	return GO_NONE;
+}
 
-	} else if (c == KEY_BACKSPACE || c == KEY_DC || c == 127) {
-		if (ptab->fdlen <= 1)
-			return GO_REDRAW;
-		char *end = ptab->find + ptab->fdlen - 1;
-		while (--end >= ptab->find && (*end & 0xC0) == 0x80);
-		*end = '\0';
-		ptab->fdlen = end - ptab->find + 1;
+static void notifysighandler(int sig)
+{
+	int err = errno;
+	unsigned char c = (unsigned char)sig;
+
+	if (sig == SIGCHLD)
+		while (waitpid(-1, NULL, WNOHANG) > 0);
+	else if (sig == SIGWINCH && cursessigwinch.sa_handler != SIG_DFL && cursessigwinch.sa_handler != SIG_IGN)
+		cursessigwinch.sa_handler(sig); // Let curses note the resize for KEY_RESIZE
+	ssize_t ret __attribute__((unused)) = write(sigfd[1], &c, 1); // A full pipe wakes the loop as well
+	errno = err;
+}
 
-	} else if (c > 31 && c < 256) {
-		ptab->find[ptab->fdlen - 1] = c;
-		ptab->find[ptab->fdlen == FILT_MAX - 1 ? ptab->fdlen : ++ptab->fdlen - 1] = '\0';
-	} else
+/* Empty the signal self-pipe. Returns SIGTERM if asked to quit, else SIGWINCH if the terminal was resized, or 0. */
+static int drainsignals(void)
+{
+	unsigned char buf[64];
+	int sig = 0;
+	ssize_t n;
+
+	while ((n = read(sigfd[0], buf, sizeof(buf))) > 0)
+		for (ssize_t i = 0; i < n; ++i)
+			if (buf[i] == SIGTERM || buf[i] == SIGHUP)
+				sig = SIGTERM;
+			else if (buf[i] == SIGWINCH && sig == 0)
+				sig = SIGWINCH;
+	return sig;
+}
+
+/* Timer handler: reload the view so new-file marks that have expired are dropped */
+static int expirenewmark(void)
+{
+	if (ptab->ftlen > 0 || ptab->fdlen > 0 || jplen > 0) { // Not while typing a filter, quick find or jump
+		settimer(T_NEWMARK, 1000);
 		return GO_NONE;
+	}
+	return refreshview(0);
+}
 
-	if (ptab->find[0] == '\0')
-		return GO_REDRAW;
+/* Wait for a key while dispatching other events: signals, finished background work and timers.
+   Returns GO_NONE when a key can be read, or the drawing an event needs. */
+static int waitevent(void)
+{
+	static int (*const timerfn[T_NUM])(void) = { [T_NEWMARK] = expirenewmark, [T_FINDLOAD] = loadfindstream };
+	static const struct { int *fd; int (*handler)(void); } srcs[] = {
+		{ &dufd, readduworker },
+		{ &idfd, readidworker },
+		{ &lnkfd, readlnkworker },
+		{ &ctlfd, acceptctl },
+		{ &findfd, readfindstream },
+		{ &cpfd, readcopy },
+	};
+	struct pollfd pfd[LENGTH(srcs) + 2 + CTL_MAX];
+	long long next, now;
+	int c, ctl;
+
+	// Keys already read by curses, such as ones put back by deferdraw, do not show on the tty
+	timeout(0);
+	c = getch();
+	timeout(-1);
+	if (c != ERR) {
+		ungetch(c);
+		return GO_NONE;
+	}
 
-	for (int i = 0; i < ndents; ++i) {
-		if (strncasecmp(pdents[i].name, ptab->find, ptab->fdlen - 1) == 0) {
-			cursel = i;
-			curscroll = MAX(i - (onscr * 3 >> 2), MIN(i - (onscr >> 2), curscroll));
-			return GO_REDRAW;
+	for (;;) {
+		pfd[0] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+		pfd[1] = (struct pollfd){ .fd = sigfd[0], .events = POLLIN };
+		for (size_t i = 0; i < LENGTH(srcs); ++i) // poll skips negative fds
+			pfd[i + 2] = (struct pollfd){ .fd = *srcs[i].fd, .events = POLLIN };
+		for (int i = 0; i < CTL_MAX; ++i)
+			pfd[LENGTH(srcs) + 2 + i] = (struct pollfd){ .fd = ctlconn[i].fd, .events = POLLIN };
+
+		next = 0;
+		for (int i = 0; i < T_NUM; ++i)
+			if (timerat[i] && (next == 0 || timerat[i] < next))
+				next = timerat[i];
+		now = monotime();
+		if (poll(pfd, LENGTH(pfd), next == 0 ? -1 : (int)MIN(MAX(next - now, 0), INT_MAX)) == -1 && errno != EINTR)
+			return GO_NONE; // Fall back to a blocking read of the key
+
+		if (pfd[1].revents && (c = drainsignals()) != 0) {
+			if (c == SIGTERM)
+				return GO_QUIT; // Quit from the loop, saving the session outside of the signal handler
+			// curses only notices a resize when a read is interrupted, tell it here
+			struct winsize ws;
+			if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
+				resizeterm(ws.ws_row, ws.ws_col);
+			return GO_NONE; // getinput() gets the KEY_RESIZE queued by resizeterm
 		}
+		for (size_t i = 0; i < LENGTH(srcs); ++i)
+			if (pfd[i + 2].revents && (ctl = srcs[i].handler()) != GO_NONE)
+				return ctl;
+		for (int i = 0; i < CTL_MAX; ++i)
+			if (pfd[LENGTH(srcs) + 2 + i].revents && (ctl = readctlclient(&ctlconn[i])) != GO_NONE)
+				return ctl;
+
+		now = monotime();
+		for (int i = 0; i < T_NUM; ++i) {
+			if (timerat[i] && timerat[i] <= now) {
+				timerat[i] = 0;
+				if ((ctl = timerfn[i]()) != GO_NONE)
+					return ctl;
+			}
+		}
+		if (pfd[0].revents)
+			return GO_NONE;
 	}
-	return qfindnext(0);
 }
 
 static void browse(void)
 {
 	for (int c, ctl = GO_RELOAD;;) {
 		switch (ctl) {
-		case GO_RELOAD:
-			ptab = &gtab[gcfg.ct];
-			loadentries(ptab->hp->path);
-
-			// fallthrough
+		case GO_RELOAD: // fallthrough
 		case GO_SORT:
-			filterentry();
-			qsort(pdents, ndents, sizeof(*pdents), ptab->cfg.reverse ? &reventrycmp : &entrycmp);
-			setcurrentstat(ptab->hp, ptab->ss);
+			reloadview(ctl);
+			if ((ctl = deferdraw(GO_REDRAW)) == GO_NONE)
+				break;
 
 			// fallthrough
+		case GO_SCROLL:
 		case GO_REDRAW:
-			redraw(ptab->hp->path);
+			if (ctl != GO_SCROLL || !scrollview())
+				redraw(ptab->hp->path);
 
 			// fallthrough
 		case GO_FASTDRAW:
@@ -2248,12 +6058,21 @@ static void browse(void)
 
 			// fallthrough
 		case GO_NONE:
+			if ((ctl = deferdraw(GO_NONE)) != GO_NONE) // Left by keys that drew nothing
+				break;
+			startduworker();
+			startidworker();
+			flushframe();
+			if ((ctl = waitevent()) != GO_NONE)
+				break;
 			c = getinput(stdscr);
 			if (c == KEY_RESIZE) {
 				ctl = GO_REDRAW;
 				break;
 			}
 
+			if ((ctl = jumpinput(c)) != GO_NONE)
+				break;
 			if ((ctl = filterinput(c)) != GO_NONE)
 				break;
 			if ((ctl = qfindinput(c)) != GO_NONE)
@@ -2266,6 +6085,8 @@ static void browse(void)
 			} else if (c < 0)
 				ctl = callextfunc(-c);
 
+			if (ctl > GO_NONE && ctl < GO_SORT)
+				ctl = deferdraw(ctl);
 			break;
 		case GO_QUIT:
 			return;
@@ -2273,15 +6094,244 @@ static void browse(void)
 	}
 }
 
-static void exitsighandler(int sig __attribute__((unused)))
+struct sessbuf {
+	char *buf;
+	size_t len, cap;
+	int err;
+};
+
+/* Append n bytes to the session being written. Errors are kept in sb->err, so calls need no checks. */
+static void sessput(struct sessbuf *sb, const void *data, size_t n)
+{
+	if (sb->err)
+		return;
+	if (sb->len + n > sb->cap) {
+		size_t cap = MAX(sb->cap * 2, sb->len + n + NAME_INCR);
+		char *tmp = realloc(sb->buf, cap);
+		if (!tmp) {
+			sb->err = errno;
+			return;
+		}
+		sb->buf = tmp;
+		sb->cap = cap;
+	}
+	memcpy(sb->buf + sb->len, data, n);
+	sb->len += n;
+}
+
+/* Take n bytes at *p of a mapped session into dst. Returns FALSE past end. */
+static int sessget(const char **p, const char *end, void *dst, size_t n)
 {
-	endwin();
-	exit(EXIT_SUCCESS);
+	if ((size_t)(end - *p) < n)
+		return FALSE;
+	memcpy(dst, *p, n);
+	*p += n;
+	return TRUE;
+}
+
+/*
+ * Session file: SESS_MAGIC, then sizes of Settings and Histstat, current and last tab, and the
+ * number of tabs. Each tab is its index, its current Histpath (0 or 1), its Settings, both its
+ * Histpaths (path length, number of Histstats, index of the current one, path, Histstats), and
+ * its selections (number of directories, then per directory the path length, number of names,
+ * path, and per name its category, size, length and the name).
+ */
+static void savesession(void)
+{
+	struct sessbuf sb = {NULL, 0, 0, 0};
+	unsigned int hdr[5] = {sizeof(Settings), sizeof(Histstat), gcfg.ct, gcfg.lt, 0};
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+
+	if (!cfgpath || !makecfgdir() || !makepath(cfgpath, SESS_FILE, path))
+		return;
+	savehiststat(ptab->hp->stat);
+	if (hdr[2] == TABS_MAX) // The search tab is not saved
+		hdr[2] = gcfg.lt;
+	for (int t = 0; t < TABS_MAX; ++t)
+		hdr[4] += gtab[t].cfg.enabled;
+
+	sessput(&sb, SESS_MAGIC, sizeof(SESS_MAGIC) - 1);
+	sessput(&sb, hdr, sizeof(hdr));
+	for (unsigned int t = 0; t < TABS_MAX; ++t) {
+		Tabs *tab = &gtab[t];
+		unsigned int th[2] = {t, tab->hp - &ghpath[t * 2]}, nss = 0;
+		struct selstat *ss = tab->ss;
+
+		if (!tab->cfg.enabled)
+			continue;
+		sessput(&sb, th, sizeof(th));
+		sessput(&sb, &tab->cfg, sizeof(Settings));
+		for (int i = 0; i < 2; ++i) {
+			Histpath *hp = &ghpath[t * 2 + i];
+			unsigned int h[3] = {strlen(hp->path) + 1, hp->nhs, hp->nhs ? hp->stat - hp->hs : 0};
+			sessput(&sb, h, sizeof(h));
+			sessput(&sb, hp->path, h[0]);
+			sessput(&sb, hp->hs, hp->nhs * sizeof(Histstat));
+		}
+
+		while (ss && ss->prev)
+			ss = ss->prev;
+		for (struct selstat *n = ss; n; n = n->next)
+			++nss;
+		sessput(&sb, &nss, sizeof(nss));
+		for (; ss; ss = ss->next) {
+			unsigned int h[2] = {strlen(ss->path) + 1, ss->nname};
+			sessput(&sb, h, sizeof(h));
+			sessput(&sb, ss->path, h[0]);
+			for (char *pos = ss->nbuf; pos < ss->endp; pos += strlen(pos + 1) + 2) {
+				struct selslot *slot = *pos ? findselslot(ss, pos + 1, hashstr(pos + 1)) : NULL;
+				unsigned int nlen = strlen(pos + 1) + 1;
+				if (!slot)
+					continue;
+				sessput(&sb, &slot->cat, sizeof(slot->cat));
+				sessput(&sb, &slot->size, sizeof(slot->size));
+				sessput(&sb, &nlen, sizeof(nlen));
+				sessput(&sb, pos + 1, nlen);
+			}
+		}
+	}
+
+	// Replace the old session only once the new one is complete
+	memcpy(tmp, path, PATH_MAX);
+	strcat(tmp, ".tmp");
+	if (!sb.err && (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1) {
+		int ok = writeall(fd, sb.buf, sb.len) && fsync(fd) == 0; // On disk before it replaces the old one
+		if (close(fd) == -1 || !ok || rename(tmp, path) == -1)
+			unlink(tmp);
+	}
+	free(sb.buf);
+}
+
+static int restorehistpath(Histpath *hp, const char **p, const char *end)
+{
+	unsigned int h[3]; // Path length, number of Histstats, index of the current one
+
+	if (!sessget(p, end, h, sizeof(h)) || h[0] == 0 || h[0] > PATH_MAX
+	|| h[1] > (size_t)(end - *p) / sizeof(Histstat) || (h[1] > 0 && h[2] >= h[1])
+	|| !sessget(p, end, hp->path, h[0]) || hp->path[h[0] - 1] != '\0')
+		return FALSE;
+
+	if (h[1] == 0) { // Not used
+		hp->path[0] = '\0';
+		return TRUE;
+	}
+	if (h[1] > hp->ths) {
+		unsigned int ths = (h[1] + HSTAT_INCR - 1) / HSTAT_INCR * HSTAT_INCR;
+		Histstat *tmphs = realloc(hp->hs, ths * sizeof(Histstat));
+		if (!tmphs && seterrnum(__LINE__, errno))
+			return FALSE;
+		hp->hs = tmphs;
+		hp->ths = ths;
+	}
+	if (!sessget(p, end, hp->hs, h[1] * sizeof(Histstat)))
+		return FALSE;
+	for (unsigned int i = 0; i < h[1]; ++i)
+		hp->hs[i].name[NAME_MAX] = '\0';
+	hp->nhs = h[1];
+	hp->stat = hp->hs + h[2];
+	return TRUE;
+}
+
+static int restoreselection(Tabs *tab, const char **p, const char *end)
+{
+	unsigned int h[2], nlen; // Path length and number of names
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	struct selstat *ss;
+	int cat;
+	off_t size;
+
+	if (!sessget(p, end, h, sizeof(h)) || h[0] < 2 || h[0] > PATH_MAX
+	|| !sessget(p, end, path, h[0]) || path[h[0] - 1] != '\0' || path[0] != '/')
+		return FALSE;
+	if (!(ss = newselstat(tab, path)))
+		return FALSE;
+	tab->ss = ss;
+
+	for (unsigned int i = 0; i < h[1]; ++i) {
+		if (!sessget(p, end, &cat, sizeof(cat)) || !sessget(p, end, &size, sizeof(size))
+		|| !sessget(p, end, &nlen, sizeof(nlen)) || nlen < 2 || nlen > NAME_MAX + 1 || cat < 0 || cat > 3
+		|| !sessget(p, end, name, nlen) || name[nlen - 1] != '\0')
+			return FALSE;
+		if (!addselname(tab, ss, name, nlen, cat, size))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Set up the tabs saved in a mapped session */
+static int restoresession(const char *p, const char *end)
+{
+	unsigned int hdr[5], th[2], nss;
+	char magic[sizeof(SESS_MAGIC) - 1];
+	Tabs *tab;
+
+	if (!sessget(&p, end, magic, sizeof(magic)) || memcmp(magic, SESS_MAGIC, sizeof(magic)) != 0
+	|| !sessget(&p, end, hdr, sizeof(hdr)) || hdr[0] != sizeof(Settings) || hdr[1] != sizeof(Histstat)
+	|| hdr[2] >= TABS_MAX || hdr[3] >= TABS_MAX || hdr[4] == 0 || hdr[4] > TABS_MAX)
+		return FALSE;
+
+	for (unsigned int t = 0; t < hdr[4]; ++t) {
+		if (!sessget(&p, end, th, sizeof(th)) || th[0] >= TABS_MAX || th[1] > 1 || gtab[th[0]].cfg.enabled)
+			return FALSE;
+		tab = &gtab[th[0]];
+		if (!sessget(&p, end, &tab->cfg, sizeof(Settings))
+		|| !restorehistpath(&ghpath[th[0] * 2], &p, end) || !restorehistpath(&ghpath[th[0] * 2 + 1], &p, end)
+		|| !(tab->hp = &ghpath[th[0] * 2 + th[1]])->path[0])
+			return FALSE;
+
+		tab->ftlen = tab->fdlen = 0;
+		tab->ftmode = FM_SUBSTR;
+		tab->nde = tab->nsel = 0;
+		tab->cfg.enabled = 1;
+		tab->cfg.havesel = 0;
+		if (!sessget(&p, end, &nss, sizeof(nss)))
+			return FALSE;
+		for (unsigned int i = 0; i < nss; ++i)
+			if (!restoreselection(tab, &p, end))
+				return FALSE;
+	}
+
+	if (!gtab[hdr[2]].cfg.enabled || chdir(gtab[hdr[2]].hp->path) == -1)
+		return FALSE;
+	gcfg.ct = hdr[2];
+	gcfg.lt = gtab[hdr[3]].cfg.enabled ? hdr[3] : hdr[2];
+	findname = gtab[hdr[2]].hp->stat->name;
+	return TRUE;
 }
 
-static void childsighandler(int sig __attribute__((unused)))
+/* Restore the tabs saved by savesession(), reading the file with one mmap(). Returns FALSE if
+   there is no usable session, with all tabs left closed. */
+static int loadsession(void)
 {
-	while (waitpid(-1, NULL, WNOHANG) > 0);
+	struct stat sb;
+	char *map;
+	int fd, ok;
+
+	if (!cfgpath || !makepath(cfgpath, SESS_FILE, gpbuf) || (fd = open(gpbuf, O_RDONLY | O_CLOEXEC)) == -1)
+		return FALSE;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0
+	|| (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return FALSE;
+	}
+	close(fd);
+
+	ok = restoresession(map, map + sb.st_size);
+	munmap(map, sb.st_size);
+	if (ok)
+		return TRUE;
+
+	for (int t = 0; t < TABS_MAX; ++t) {
+		deleteallselstat(&gtab[t]);
+		gtab[t].cfg.enabled = 0;
+		gtab[t].nsel = 0;
+		for (int i = 0; i < 2; ++i) {
+			ghpath[t * 2 + i].path[0] = '\0';
+			ghpath[t * 2 + i].nhs = 0;
+		}
+	}
+	return FALSE;
 }
 
 static int initsff(char *arg0, char *argx)
@@ -2292,10 +6342,18 @@ static int initsff(char *arg0, char *argx)
 		return FALSE;
 	}
 
-	// Handle certain signals
-	sigaction(SIGHUP, &(struct sigaction){.sa_handler = exitsighandler}, NULL);
-	sigaction(SIGTERM, &(struct sigaction){.sa_handler = exitsighandler}, NULL);
-	sigaction(SIGCHLD, &(struct sigaction){.sa_handler = childsighandler}, NULL);
+	// Handle certain signals, SIGHUP, SIGTERM, SIGCHLD and SIGWINCH wake the main loop through sigfd
+	if (pipe(sigfd) == -1) {
+		perror(xitoa(__LINE__));
+		return FALSE;
+	}
+	for (int i = 0; i < 2; ++i) {
+		fcntl(sigfd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(sigfd[i], F_SETFL, O_NONBLOCK);
+	}
+	sigaction(SIGHUP, &(struct sigaction){.sa_handler = notifysighandler}, NULL);
+	sigaction(SIGTERM, &(struct sigaction){.sa_handler = notifysighandler}, NULL);
+	sigaction(SIGCHLD, &(struct sigaction){.sa_handler = notifysighandler}, NULL);
 	sigaction(SIGINT, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
 	sigaction(SIGQUIT, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
 	sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
@@ -2313,6 +6371,12 @@ static int initsff(char *arg0, char *argx)
 	if (!sudoer || !sudoer[0])
 		sudoer = SUDOER;
 
+	// The helper of sudo mode runs this same executable
+	if (!strchr(arg0, '/'))
+		selfpath = strdup(arg0);
+	else if (realpath(arg0, gpbuf))
+		selfpath = strdup(gpbuf);
+
 	// Set config path: XDG_CONFIG_HOME/sff or ~/.config/sff
 	char *xdgcfg = getenv("XDG_CONFIG_HOME");
 	if ((xdgcfg && xdgcfg[0] && makepath(xdgcfg, "sff", gpbuf))
@@ -2333,11 +6397,14 @@ static int initsff(char *arg0, char *argx)
 		pvfifo = strdup(strcat(gpbuf, ".pv"));
 	if (!cfgpath || !extfunc || !pipepath || !pvfifo)
 		seterrnum(__LINE__, errno);
+	initctlsock();
+	loaddirdb();
 
 	// Initialize first tab
 	if (!strchr(gcfg.cols, 'n'))
 		memccpy(gcfg.cols + MIN(strlen(gcfg.cols), 4), "n", '\0', 2);
-	if (!abspath(argx, gpbuf) || !inittab(gpbuf, 0) || chdir(ghpath[0].path) == -1) {
+	if (!(gcfg.session && !argx[0] && loadsession())
+	&& (!abspath(argx, gpbuf) || !inittab(gpbuf, 0) || chdir(ghpath[0].path) == -1)) {
 		perror(xitoa(__LINE__));
 		return FALSE;
 	}
@@ -2347,6 +6414,174 @@ static int initsff(char *arg0, char *argx)
 	return TRUE;
 }
 
+/* Returns the index of a name attribute in pstyle, adding it if new */
+static unsigned short addstyle(attr_t attr)
+{
+	unsigned int i;
+
+	for (i = F_UNKN + 1; i < nstyle && pstyle[i] != attr; ++i)
+		;
+	if (i < nstyle || i >= USHRT_MAX)
+		return i < nstyle ? i : F_REG;
+
+	if (nstyle == stylecap) {
+		attr_t *tmp = realloc(pstyle, stylecap * 2 * sizeof(attr_t));
+		if (!tmp)
+			return F_REG;
+		pstyle = tmp;
+		stylecap *= 2;
+	}
+	pstyle[nstyle] = attr;
+	return nstyle++;
+}
+
+/* Convert an SGR parameter string of LS_COLORS to a curses attribute, allocating a color pair for its colors */
+static attr_t parsesgr(char *sgr)
+{
+	static short pairs[256][2];
+	static int npair = 0;
+	int code[16], n = 0, fg = -1, bg = -1, i, *col;
+	attr_t attr = 0;
+	char *tok, *save;
+
+	for (tok = strtok_r(sgr, ";", &save); tok && n < 16; tok = strtok_r(NULL, ";", &save))
+		code[n++] = atoi(tok);
+
+	for (i = 0; i < n; ++i) {
+		switch (code[i]) {
+		case 0: fg = bg = -1;
+			attr = 0;
+			break;
+		case 1: attr |= A_BOLD;
+			break;
+		case 2: attr |= A_DIM;
+			break;
+		case 3: attr |= A_ITALIC;
+			break;
+		case 4: attr |= A_UNDERLINE;
+			break;
+		case 5: attr |= A_BLINK;
+			break;
+		case 7: attr |= A_REVERSE;
+			break;
+		case 38: // fallthrough
+		case 48: col = (code[i] == 38) ? &fg : &bg;
+			if (i + 2 < n && code[i + 1] == 5) {
+				*col = code[i + 2];
+				i += 2;
+			} else if (i + 4 < n && code[i + 1] == 2) { // nearest color of the 6x6x6 cube
+				*col = 16 + 36 * ((code[i + 2] * 5 + 127) / 255) + 6 * ((code[i + 3] * 5 + 127) / 255)
+					+ (code[i + 4] * 5 + 127) / 255;
+				i += 4;
+			}
+			break;
+		case 39: fg = -1;
+			break;
+		case 49: bg = -1;
+			break;
+		default:
+			if (code[i] >= 30 && code[i] <= 37)
+				fg = code[i] - 30;
+			else if (code[i] >= 40 && code[i] <= 47)
+				bg = code[i] - 40;
+			else if (code[i] >= 90 && code[i] <= 97)
+				fg = code[i] - 82;
+			else if (code[i] >= 100 && code[i] <= 107)
+				bg = code[i] - 92;
+		}
+	}
+
+	// Bright colors fall back to normal ones on 8 color terminals, others to the default color
+	if (fg >= COLORS)
+		fg = (fg < 16) ? fg - 8 : -1;
+	if (bg >= COLORS)
+		bg = (bg < 16) ? bg - 8 : -1;
+	if (fg == -1 && bg == -1)
+		return attr;
+
+	for (i = 0; i < npair && (pairs[i][0] != fg || pairs[i][1] != bg); ++i)
+		;
+	if (i == npair) {
+		if (npair == 256 || C_NEWFILE + 1 + npair >= COLOR_PAIRS)
+			return attr;
+		init_pair(C_NEWFILE + 1 + npair, fg, bg);
+		pairs[npair][0] = fg;
+		pairs[npair++][1] = bg;
+	}
+	return COLOR_PAIR(C_NEWFILE + 1 + i) | attr;
+}
+
+/* Parse LS_COLORS into file type styles and a hash table of suffix rules */
+static void loadlscolors(void)
+{
+	static const char types[][3] = {
+		[F_REG] = "fi", [F_DIR] = "di", [F_CHR] = "cd", [F_BLK] = "bd", [F_IFO] = "pi", [F_LNK] = "ln",
+		[F_SOCK] = "so", [F_HLNK] = "mh", [F_EXEC] = "ex", [F_EMPT] = "", [F_ORPH] = "or", [F_MISS] = "mi"
+	};
+	const char *env = getenv("LS_COLORS");
+	unsigned int next = 0, i;
+	char *key, *val, *save;
+
+	stylecap = (F_UNKN + 1) * 2;
+	if (!(pstyle = malloc(stylecap * sizeof(attr_t))) && seterrnum(__LINE__, errno))
+		return;
+	for (nstyle = 0; nstyle <= F_UNKN; ++nstyle)
+		pstyle[nstyle] = COLOR_PAIR(nstyle);
+
+	if (!env || !*env || COLORS < 8 || !(plscolors = strdup(env)))
+		return;
+
+	for (key = strtok_r(plscolors, ":", &save); key; key = strtok_r(NULL, ":", &save)) {
+		if (!(val = strchr(key, '=')) || val == key)
+			continue;
+		*val++ = '\0';
+
+		if (key[0] != '*') {
+			for (i = 0; i < LENGTH(types) && strcmp(types[i], key) != 0; ++i)
+				;
+			if (i < LENGTH(types) && strcmp(val, "target") != 0)
+				pstyle[i] = parsesgr(val);
+			continue;
+		}
+
+		// Suffixes starting with '.' go to the hash table, others are matched one by one
+		struct lsrule rule = { .sfx = ++key, .style = addstyle(parsesgr(val)) };
+		if (key[0] != '.') {
+			struct lsrule *tmp = realloc(plssfx, (nlssfx + 1) * sizeof(struct lsrule));
+			if (!tmp)
+				continue;
+			plssfx = tmp;
+			plssfx[nlssfx++] = rule;
+			continue;
+		}
+
+		for (char *p = key; *p; ++p)
+			*p = (char)tolower((unsigned char)*p);
+		rule.hash = hashstr(key);
+		if ((next + 1) * 2 > lsextcap) {
+			unsigned int cap = MAX(64, lsextcap * 2);
+			struct lsrule *tmp = calloc(cap, sizeof(struct lsrule));
+			if (!tmp)
+				continue;
+			for (i = 0; i < lsextcap; ++i) {
+				if (!plsext[i].sfx)
+					continue;
+				unsigned int j = plsext[i].hash & (cap - 1);
+				while (tmp[j].sfx)
+					j = (j + 1) & (cap - 1);
+				tmp[j] = plsext[i];
+			}
+			free(plsext);
+			plsext = tmp;
+			lsextcap = cap;
+		}
+		for (i = rule.hash & (lsextcap - 1); plsext[i].sfx && strcmp(plsext[i].sfx, key) != 0; i = (i + 1) & (lsextcap - 1))
+			;
+		next += !plsext[i].sfx;
+		plsext[i] = rule; // later rules override earlier ones, as in ls
+	}
+}
+
 static void setupcurses(void)
 {
 	cbreak();
@@ -2354,6 +6589,7 @@ static void setupcurses(void)
 	nonl();
 	curs_set(FALSE);
 	keypad(stdscr, TRUE);
+	idlok(stdscr, TRUE); // Let scrollview use the terminal's scroll region
 	set_escdelay(50);
 
 	define_key("\033[1;5A", CTRL_UP);
@@ -2367,33 +6603,78 @@ static void setupcurses(void)
 		setcolorpair256();
 	else
 		setcolorpair8();
+	loadlscolors();
 	getmaxyx(stdscr, xlines, xcols);
+	// Installed after curses set up its own handler, which ours calls
+	sigaction(SIGWINCH, &(struct sigaction){.sa_handler = notifysighandler}, &cursessigwinch);
 	onscr = xlines - 4;
 }
 
 static void cleanup(void)
 {
+	if (gcfg.session && ptab)
+		savesession();
 	setpreview(2);
 	if (pipepath)
 		unlink(pipepath);
+	if (sockpath)
+		unlink(sockpath);
+	for (int i = 0; ctlfd != -1 && i < CTL_MAX; ++i) {
+		if (ctlconn[i].fd != -1)
+			close(ctlconn[i].fd);
+		free(ctlconn[i].res);
+	}
 	for (int i = 0; i <= TABS_MAX; ++i) {
 		free(ghpath[i * 2].hs);
 		free(ghpath[i * 2 + 1].hs);
-		deleteallselstat(gtab[i].ss);
+		deleteallselstat(&gtab[i]);
+		free(gtab[i].ssmap);
 	}
+	if (dufd != -1)
+		close(dufd);
+	if (idfd != -1)
+		close(idfd);
+	if (cpfd != -1) // The copy goes on
+		close(cpfd);
+	cancelfind();
+	stophelper();
+	freedirdb();
+	close(sigfd[0]);
+	close(sigfd[1]);
+	for (unsigned int i = 0; i < ducachecap; ++i)
+		free(pducache[i].path);
 
 	free(pdents);
+	free(pfoldidx);
+	free(phitidx);
+	free(pnameidx);
+	free(pfoldmin);
+	free(pducache);
+	free(pdispidx);
+	free(pdispbuf);
+	free(plnkbuf);
+	free(pstyle);
+	free(plsext);
+	free(plssfx);
+	free(plscolors);
+	free(pduqueue);
+	free(pidcache);
+	free(pidqueue);
+	free(plnkres);
 	free(pnamebuf);
 	free(pfindbuf);
 	free(cfgpath);
 	free(extfunc);
 	free(pipepath);
+	free(sockpath);
 	free(pvfifo);
+	free(selfpath);
+	free(dirlogpath);
 }
 
 int main(int argc, char *argv[])
 {
-	for (int opt; (opt = getopt(argc, argv, "dHl:moph")) != -1;) {
+	for (int opt; (opt = getopt(argc, argv, "dHl:mopshP")) != -1;) {
 		switch (opt) {
 		case 'd': gcfg.abbrdate = 1;
 			break;
@@ -2407,8 +6688,12 @@ int main(int argc, char *argv[])
 			break;
 		case 'p': gcfg.symbperm = 1;
 			break;
+		case 's': gcfg.session = 1;
+			break;
 		case 'h': usage();
 			return EXIT_SUCCESS;
+		case 'P': // Privileged helper, started by sff itself in sudo mode
+			return runhelper() ? EXIT_SUCCESS : EXIT_FAILURE;
 		default: usage();
 			return EXIT_FAILURE;
 		}
@@ -2420,6 +6705,7 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 
 	setlocale(LC_ALL, "");
+	syncout = querysyncout();
 
 	if (!initscr())
 		return EXIT_FAILURE;